@@ -62,10 +62,18 @@ int client_request_handler(sock *client, unsigned long client_num, unsigned int
     host_config *conf = NULL;
     long content_length = 0;
     FILE *file = NULL;
+    long file_off = 0;
+    http_range ranges[HTTP_MAX_RANGES];
+    int range_num = 0;
+    char range_hdr[HTTP_MAX_RANGES][256], boundary[64];
+    int range_hdr_len[HTTP_MAX_RANGES];
     msg_buf[0] = 0;
-    int accept_if_modified_since = 0;
     int use_fastcgi = 0;
     int use_rev_proxy = 0;
+    unsigned long rev_proxy_len = 0;
+    int rev_proxy_chunked = 0, rev_proxy_complete = 0;
+    char *rev_proxy_buf = NULL;
+    long rev_proxy_buf_len = 0;
     int p_len;
     fastcgi_conn php_fpm = {.socket = 0, .req_id = 0};
     http_status custom_status;
@@ -153,6 +161,13 @@ int client_request_handler(sock *client, unsigned long client_num, unsigned int
 
     http_uri uri;
     unsigned char dir_mode = conf->type == CONFIG_TYPE_LOCAL ? conf->local.dir_mode : URI_DIR_MODE_NO_VALIDATION;
+    if (dir_mode != URI_DIR_MODE_NO_VALIDATION && client->enc && strcmp(req.method, "TRACE") != 0 &&
+            cache_neg_lookup(conf->local.webroot, req.uri)) {
+        // known to be missing, skip all file system lookups
+        memset(&uri, 0, sizeof(uri));
+        res.status = http_get_status(404);
+        goto respond;
+    }
     ret = uri_init(&uri, conf->local.webroot, req.uri, dir_mode);
     if (ret != 0) {
         if (ret == 1) {
@@ -236,11 +251,12 @@ int client_request_handler(sock *client, unsigned long client_num, unsigned int
             res.status = http_get_status(501);
             sprintf(err_msg, "Listing contents of an directory is currently not implemented.");
             goto respond;
-        } else if (uri.filename == NULL || (strlen(uri.pathinfo) > 0 && (int) uri.is_static)) {
-            res.status = http_get_status(404);
-            goto respond;
-        } else if (strlen(uri.pathinfo) != 0 && conf->local.dir_mode != URI_DIR_MODE_INFO) {
+        } else if (uri.filename == NULL || (strlen(uri.pathinfo) > 0 && (int) uri.is_static) ||
+                (strlen(uri.pathinfo) != 0 && conf->local.dir_mode != URI_DIR_MODE_INFO)) {
             res.status = http_get_status(404);
+            if (strncmp(uri.req_path, "/.well-known/", 13) != 0) {
+                cache_neg_store(conf->local.webroot, req.uri);
+            }
             goto respond;
         }
 
@@ -266,43 +282,47 @@ int client_request_handler(sock *client, unsigned long client_num, unsigned int
             }
             char *last_modified = http_format_date(uri.meta->stat.st_mtime, buf0, sizeof(buf0));
             http_add_header_field(&res.hdr, "Last-Modified", last_modified);
-            sprintf(buf1, "%s; charset=%s", uri.meta->type, uri.meta->charset);
-            http_add_header_field(&res.hdr, "Content-Type", buf1);
+            if (uri.meta->charset[0] != 0) {
+                sprintf(buf1, "%s; charset=%s", uri.meta->type, uri.meta->charset);
+                http_add_header_field(&res.hdr, "Content-Type", buf1);
+            } else {
+                // charset not yet detected by the cache updater
+                http_add_header_field(&res.hdr, "Content-Type", uri.meta->type);
+            }
 
 
+            // select the variant by metadata only, files are not opened before conditions are evaluated
             char *accept_encoding = http_get_header_field(&req.hdr, "Accept-Encoding");
             int enc = 0;
             if (accept_encoding != NULL) {
-                if (uri.meta->filename_comp_br[0] != 0 && strstr(accept_encoding, "br") != NULL) {
-                    file = fopen(uri.meta->filename_comp_br, "rb");
-                    if (file == NULL) {
-                        cache_filename_comp_invalid(uri.filename);
-                    } else {
-                        http_add_header_field(&res.hdr, "Content-Encoding", "br");
-                        enc = COMPRESS_BR;
-                    }
-                } else if (uri.meta->filename_comp_gz[0] != 0 && strstr(accept_encoding, "gzip") != NULL) {
-                    file = fopen(uri.meta->filename_comp_gz, "rb");
-                    if (file == NULL) {
-                        cache_filename_comp_invalid(uri.filename);
-                    } else {
-                        http_add_header_field(&res.hdr, "Content-Encoding", "gzip");
-                        enc = COMPRESS_GZ;
-                    }
+                int available = 0;
+                if (uri.meta->filename_comp_gz[0] != 0 && !cache_neg_lookup("", uri.meta->filename_comp_gz)) {
+                    available |= COMPRESS_GZ;
+                }
+                if (uri.meta->filename_comp_br[0] != 0 && !cache_neg_lookup("", uri.meta->filename_comp_br)) {
+                    available |= COMPRESS_BR;
                 }
-                if (enc != 0) {
-                    http_add_header_field(&res.hdr, "Vary", "Accept-Encoding");
+                if (uri.meta->filename_comp_zst[0] != 0 && !cache_neg_lookup("", uri.meta->filename_comp_zst)) {
+                    available |= COMPRESS_ZSTD;
                 }
+                enc = http_select_encoding(accept_encoding, available, 0);
+            }
+            if (uri.meta->filename_comp_gz[0] != 0 || uri.meta->filename_comp_br[0] != 0 ||
+                    uri.meta->filename_comp_zst[0] != 0) {
+                http_merge_vary(&res.hdr, "Accept-Encoding");
             }
 
+            char etag[128];
+            etag[0] = 0;
             if (uri.meta->etag[0] != 0) {
-                if (enc) {
-                    sprintf(buf0, "%s-%s", uri.meta->etag,
-                            (enc & COMPRESS_BR) ? "br" : (enc & COMPRESS_GZ) ? "gzip" : "");
-                    http_add_header_field(&res.hdr, "ETag", buf0);
-                } else {
-                    http_add_header_field(&res.hdr, "ETag", uri.meta->etag);
-                }
+                sprintf(etag, "\"%s%s\"", uri.meta->etag,
+                        (enc & COMPRESS_BR) ? "-br" : (enc & COMPRESS_ZSTD) ? "-zstd" : (enc & COMPRESS_GZ) ? "-gzip" : "");
+            } else {
+                // the hash is still pending, use a weak validator until then
+                cache_weak_etag(uri.meta, etag, sizeof(etag));
+            }
+            if (etag[0] != 0) {
+                http_add_header_field(&res.hdr, "ETag", etag);
             }
 
             if (strncmp(uri.meta->type, "text/", 5) == 0) {
@@ -311,66 +331,172 @@ int client_request_handler(sock *client, unsigned long client_num, unsigned int
                 http_add_header_field(&res.hdr, "Cache-Control", "public, max-age=86400");
             }
 
-            char *if_modified_since = http_get_header_field(&req.hdr, "If-Modified-Since");
+            // RFC 7232, section 6: If-Modified-Since is only evaluated without If-None-Match
             char *if_none_match = http_get_header_field(&req.hdr, "If-None-Match");
-            if ((if_none_match != NULL && strstr(if_none_match, uri.meta->etag) == NULL) ||
-                    (accept_if_modified_since && if_modified_since != NULL &&
-                    strcmp(if_modified_since, last_modified) == 0)) {
-                res.status = http_get_status(304);
-                goto respond;
+            char *if_modified_since = http_get_header_field(&req.hdr, "If-Modified-Since");
+            if (if_none_match != NULL) {
+                // tags issued before and after hashing the file are both accepted
+                char weak_etag[64];
+                if (http_etag_match(if_none_match, etag) || (uri.meta->etag[0] != 0 &&
+                        cache_weak_etag(uri.meta, weak_etag, sizeof(weak_etag)) == 0 &&
+                        http_etag_match(if_none_match, weak_etag))) {
+                    res.status = http_get_status(304);
+                    goto respond;
+                }
+            } else if (if_modified_since != NULL) {
+                time_t date = http_parse_date(if_modified_since);
+                if (date != -1 && uri.meta->stat.st_mtime <= date) {
+                    res.status = http_get_status(304);
+                    goto respond;
+                }
+            }
+
+            if (enc & COMPRESS_BR) {
+                file = fopen(uri.meta->filename_comp_br, "rb");
+                if (file == NULL) {
+                    cache_neg_store("", uri.meta->filename_comp_br);
+                    cache_filename_comp_invalid(uri.filename);
+                } else {
+                    http_add_header_field(&res.hdr, "Content-Encoding", "br");
+                }
+            } else if (enc & COMPRESS_ZSTD) {
+                file = fopen(uri.meta->filename_comp_zst, "rb");
+                if (file == NULL) {
+                    cache_neg_store("", uri.meta->filename_comp_zst);
+                    cache_filename_comp_invalid(uri.filename);
+                } else {
+                    http_add_header_field(&res.hdr, "Content-Encoding", "zstd");
+                }
+            } else if (enc & COMPRESS_GZ) {
+                file = fopen(uri.meta->filename_comp_gz, "rb");
+                if (file == NULL) {
+                    cache_neg_store("", uri.meta->filename_comp_gz);
+                    cache_filename_comp_invalid(uri.filename);
+                } else {
+                    http_add_header_field(&res.hdr, "Content-Encoding", "gzip");
+                }
+            }
+            if (enc && file == NULL) {
+                // compressed file is gone, fall back to the uncompressed one
+                enc = 0;
+                http_remove_header_field(&res.hdr, "ETag", HTTP_REMOVE_ALL);
+                if (uri.meta->etag[0] != 0) {
+                    sprintf(etag, "\"%s\"", uri.meta->etag);
+                    http_add_header_field(&res.hdr, "ETag", etag);
+                }
             }
 
             char *range = http_get_header_field(&req.hdr, "Range");
+            char *if_range = http_get_header_field(&req.hdr, "If-Range");
+            if (range != NULL && if_range != NULL) {
+                // only send a part if the client's copy is still current, otherwise send everything
+                unsigned long len = strlen(if_range);
+                if (len >= 2 && if_range[0] == '"' && if_range[len - 1] == '"') {
+                    if (uri.meta->etag[0] == 0 || strlen(uri.meta->etag) != len - 2 ||
+                            strncmp(if_range + 1, uri.meta->etag, len - 2) != 0) {
+                        range = NULL;
+                    }
+                } else {
+                    // RFC 7233, section 3.2: a date only validates if it is a strong validator, i.e. the file
+                    // was last modified at least one second before the Date of this response
+                    const struct timespec *mtime = &uri.meta->stat.st_mtim;
+                    char *date_str = http_get_header_field(&res.hdr, "Date");
+                    time_t date = http_parse_date(if_range);
+                    time_t now = date_str != NULL ? http_parse_date(date_str) : -1;
+                    if (date == -1 || date != mtime->tv_sec || now == -1 ||
+                            mtime->tv_sec + 1 > now || (mtime->tv_sec + 1 == now && mtime->tv_nsec != 0)) {
+                        range = NULL;
+                    }
+                }
+            }
+            FILE *range_file = NULL;
+            struct stat range_stat;
+            if (range != NULL) {
+                // sizes are taken from the opened file, the cached metadata may already be outdated
+                range_file = fopen(uri.filename, "rb");
+                if (range_file == NULL || fstat(fileno(range_file), &range_stat) != 0) {
+                    if (range_file != NULL) fclose(range_file);
+                    if (file != NULL) fclose(file);
+                    file = NULL;
+                    res.status = http_get_status(500);
+                    goto respond;
+                }
+                if (range_stat.st_ino != uri.meta->stat.st_ino || range_stat.st_size != uri.meta->stat.st_size ||
+                        memcmp(&range_stat.st_mtim, &uri.meta->stat.st_mtim, sizeof(range_stat.st_mtim)) != 0) {
+                    // changed since its validators were determined, the client's copy cannot be checked
+                    range = NULL;
+                }
+            }
             if (range != NULL) {
-                if (strlen(range) <= 6 || strncmp(range, "bytes=", 6) != 0) {
+                unsigned long file_len = range_stat.st_size;
+                range_num = http_parse_ranges(range, file_len, ranges, HTTP_MAX_RANGES);
+                if (range_num == 0) {
                     res.status = http_get_status(416);
                     http_remove_header_field(&res.hdr, "Content-Type", HTTP_REMOVE_ALL);
                     http_remove_header_field(&res.hdr, "Last-Modified", HTTP_REMOVE_ALL);
                     http_remove_header_field(&res.hdr, "ETag", HTTP_REMOVE_ALL);
                     http_remove_header_field(&res.hdr, "Cache-Control", HTTP_REMOVE_ALL);
+                    sprintf(buf0, "bytes */%li", file_len);
+                    http_add_header_field(&res.hdr, "Content-Range", buf0);
+                    fclose(range_file);
+                    if (file != NULL) {
+                        fclose(file);
+                        file = NULL;
+                    }
                     goto respond;
                 }
-                range += 6;
-                char *ptr = strchr(range, '-');
-                if (ptr == NULL) {
-                    res.status = http_get_status(416);
-                    goto respond;
+            }
+            if (range_num <= 0 && range_file != NULL) {
+                fclose(range_file);
+            } else if (range_num > 0) {
+                // ranges always refer to the uncompressed file
+                if (enc) {
+                    fclose(file);
+                    http_remove_header_field(&res.hdr, "Content-Encoding", HTTP_REMOVE_ALL);
+                    http_remove_header_field(&res.hdr, "ETag", HTTP_REMOVE_ALL);
+                    if (uri.meta->etag[0] != 0) {
+                        sprintf(etag, "\"%s\"", uri.meta->etag);
+                        http_add_header_field(&res.hdr, "ETag", etag);
+                    }
                 }
-                file = fopen(uri.filename, "rb");
-                fseek(file, 0, SEEK_END);
-                unsigned long file_len = ftell(file);
-                fseek(file, 0, SEEK_SET);
-                if (file_len == 0) {
-                    content_length = 0;
+                file = range_file;
+                unsigned long file_len = range_stat.st_size;
+                res.status = http_get_status(206);
+                if (range_num == 1) {
+                    sprintf(buf0, "bytes %li-%li/%li", ranges[0].start, ranges[0].end, file_len);
+                    http_add_header_field(&res.hdr, "Content-Range", buf0);
+                    file_off = (long) ranges[0].start;
+                    content_length = (long) (ranges[0].end - ranges[0].start + 1);
                     goto respond;
                 }
-                long num1 = 0;
-                long num2 = (long) file_len - 1;
 
-                if (ptr != range) num1 = (long) strtoul(range, NULL, 10);
-                if (ptr[1] != 0) num2 = (long) strtoul(ptr + 1, NULL, 10);
-
-                if (num1 >= file_len || num2 >= file_len || num1 > num2) {
-                    res.status = http_get_status(416);
-                    goto respond;
+                // multipart/byteranges, part headers are prepared here so that the length is known
+                char *content_type = http_get_header_field(&res.hdr, "Content-Type");
+                sprintf(boundary, "%lx%lx%lx%x", begin.tv_sec, begin.tv_nsec, client_num, req_num);
+                content_length = 0;
+                for (int i = 0; i < range_num; i++) {
+                    range_hdr_len[i] = snprintf(range_hdr[i], sizeof(range_hdr[i]),
+                                                "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %li-%li/%li\r\n\r\n",
+                                                boundary, content_type, ranges[i].start, ranges[i].end, file_len);
+                    content_length += range_hdr_len[i] + (long) (ranges[i].end - ranges[i].start + 1);
                 }
-                sprintf(buf0, "bytes %li-%li/%li", num1, num2, file_len);
-                http_add_header_field(&res.hdr, "Content-Range", buf0);
-
-                res.status = http_get_status(206);
-                fseek(file, num1, SEEK_SET);
-                content_length = num2 - num1 + 1;
-
+                content_length += (long) strlen(boundary) + 8;
+                http_remove_header_field(&res.hdr, "Content-Type", HTTP_REMOVE_ALL);
+                sprintf(buf0, "multipart/byteranges; boundary=%s", boundary);
+                http_add_header_field(&res.hdr, "Content-Type", buf0);
                 goto respond;
             }
 
             if (file == NULL) {
                 file = fopen(uri.filename, "rb");
             }
-
-            fseek(file, 0, SEEK_END);
-            content_length = ftell(file);
-            fseek(file, 0, SEEK_SET);
+            if (file == NULL) {
+                res.status = http_get_status(500);
+                goto respond;
+            }
+            struct stat statbuf;
+            fstat(fileno(file), &statbuf);
+            content_length = statbuf.st_size;
         } else {
             struct stat statbuf;
             stat(uri.filename, &statbuf);
@@ -427,21 +553,78 @@ int client_request_handler(sock *client, unsigned long client_num, unsigned int
             content_length = -1;
             use_fastcgi = 1;
 
+            // HEAD and 204/304 responses have no body to measure, event streams are passed on as they come
+            int no_body = res.status->code == 204 || res.status->code == 304;
+            int buffered = strcmp(req.method, "HEAD") != 0 && !no_body &&
+                           !mime_is_stream(http_get_header_field(&res.hdr, "Content-Type"));
+            if (buffered && fastcgi_buffer(&php_fpm, COMPRESS_BUFFER_SIZE) != 0) {
+                res.status = http_get_status(502);
+                sprintf(err_msg, "Unable to communicate with PHP-FPM.");
+                goto respond;
+            }
+
             int http_comp = http_get_compression(&req, &res);
-            if (http_comp & COMPRESS) {
-                if (http_comp & COMPRESS_BR) {
-                    use_fastcgi |= FASTCGI_COMPRESS_BR;
-                    sprintf(buf0, "br");
-                } else if (http_comp & COMPRESS_GZ) {
-                    use_fastcgi |= FASTCGI_COMPRESS_GZ;
-                    sprintf(buf0, "gzip");
+            if (no_body) {
+                http_remove_header_field(&res.hdr, "Content-Length", HTTP_REMOVE_ALL);
+                content_length = 0;
+            } else if (buffered && php_fpm.socket == 0) {
+                // whole body buffered, send it with an exact length
+                char *body = php_fpm.out_buf + php_fpm.out_off;
+                unsigned long body_len = php_fpm.out_len - php_fpm.out_off;
+                if (http_comp & COMPRESS) {
+                    http_merge_vary(&res.hdr, "Accept-Encoding");
+                    if (body_len >= compress_min_size && !compress_incompressible(body, body_len) &&
+                        compress_dynamic_level(http_comp) >= 0) {
+                        char *comp_buf = malloc(body_len);
+                        long comp_len = -1;
+                        if (comp_buf != NULL) comp_len = compress_buffer(http_comp, body, body_len, comp_buf, body_len);
+                        if (comp_len > 0) {
+                            free(php_fpm.out_buf);
+                            php_fpm.out_buf = comp_buf;
+                            php_fpm.out_off = 0;
+                            php_fpm.out_len = comp_len;
+                            body_len = comp_len;
+                            http_add_header_field(&res.hdr, "Content-Encoding", (http_comp & COMPRESS_BR) ? "br" :
+                                                  (http_comp & COMPRESS_ZSTD) ? "zstd" : "gzip");
+                        } else {
+                            free(comp_buf);
+                        }
+                    }
+                }
+                http_remove_header_field(&res.hdr, "Content-Length", HTTP_REMOVE_ALL);
+                content_length = (long) body_len;
+            } else {
+                if (http_comp & COMPRESS) {
+                    // small, already compressed or overloaded: not worth spending worker CPU
+                    char *res_content_length = http_get_header_field(&res.hdr, "Content-Length");
+                    if (res_content_length != NULL && strtoul(res_content_length, NULL, 10) < compress_min_size) {
+                        http_comp = 0;
+                    } else if (compress_incompressible(php_fpm.out_buf + php_fpm.out_off,
+                                                       php_fpm.out_len - php_fpm.out_off)) {
+                        http_comp = 0;
+                    } else if (compress_dynamic_level(http_comp) < 0) {
+                        http_comp = 0;
+                    }
+                }
+                if (http_comp & COMPRESS) {
+                    http_remove_header_field(&res.hdr, "Content-Length", HTTP_REMOVE_ALL);
+                    if (http_comp & COMPRESS_BR) {
+                        use_fastcgi |= FASTCGI_COMPRESS_BR;
+                        sprintf(buf0, "br");
+                    } else if (http_comp & COMPRESS_ZSTD) {
+                        use_fastcgi |= FASTCGI_COMPRESS_ZSTD;
+                        sprintf(buf0, "zstd");
+                    } else if (http_comp & COMPRESS_GZ) {
+                        use_fastcgi |= FASTCGI_COMPRESS_GZ;
+                        sprintf(buf0, "gzip");
+                    }
+                    http_merge_vary(&res.hdr, "Accept-Encoding");
+                    http_add_header_field(&res.hdr, "Content-Encoding", buf0);
                 }
-                http_add_header_field(&res.hdr, "Vary", "Accept-Encoding");
-                http_add_header_field(&res.hdr, "Content-Encoding", buf0);
-            }
 
-            if (http_get_header_field(&res.hdr, "Content-Length") == NULL) {
-                http_add_header_field(&res.hdr, "Transfer-Encoding", "chunked");
+                if (http_get_header_field(&res.hdr, "Content-Length") == NULL) {
+                    http_add_header_field(&res.hdr, "Transfer-Encoding", "chunked");
+                }
             }
         }
     } else if (conf->type == CONFIG_TYPE_REVERSE_PROXY) {
@@ -452,29 +635,103 @@ int client_request_handler(sock *client, unsigned long client_num, unsigned int
         ret = rev_proxy_init(&req, &res, conf, client, &custom_status, err_msg);
         use_rev_proxy = (ret == 0);
 
-        /*
-        char *content_encoding = http_get_header_field(&res.hdr, "Content-Encoding");
-        if (use_rev_proxy && content_encoding == NULL) {
-            int http_comp = http_get_compression(&req, &res);
+        if (use_rev_proxy) {
+            char *transfer_encoding = http_get_header_field(&res.hdr, "Transfer-Encoding");
+            char *content_len = http_get_header_field(&res.hdr, "Content-Length");
+            rev_proxy_chunked = transfer_encoding != NULL && strstr(transfer_encoding, "chunked") != NULL;
+            if (content_len != NULL) rev_proxy_len = strtoul(content_len, NULL, 10);
+
+            if (strcmp(req.method, "HEAD") != 0 && res.status->code >= 200 && res.status->code != 204 &&
+                res.status->code != 304 && (rev_proxy_chunked || content_len != NULL) &&
+                !mime_is_stream(http_get_header_field(&res.hdr, "Content-Type"))) {
+                rev_proxy_buf = malloc(COMPRESS_BUFFER_SIZE);
+                long buf_len = -1;
+                if (rev_proxy_buf != NULL) {
+                    buf_len = rev_proxy_buffer(rev_proxy_buf, COMPRESS_BUFFER_SIZE, &rev_proxy_len, &rev_proxy_chunked);
+                }
+                if (buf_len < 0) {
+                    http_free_hdr(&res.hdr);
+                    res.status = http_get_status(502);
+                    sprintf(err_msg, "Unable to receive response from server.");
+                    use_rev_proxy = 0;
+                    goto respond;
+                }
+                rev_proxy_buf_len = buf_len;
+                rev_proxy_complete = !rev_proxy_chunked && rev_proxy_len == 0;
+            }
+        }
+
+        char *cache_control = http_get_header_field(&res.hdr, "Cache-Control");
+        int http_comp = 0, rev_proxy_comp = 0;
+        if (use_rev_proxy && res.status->code != 204 && res.status->code != 206 && res.status->code != 304 &&
+            (cache_control == NULL || strstr(cache_control, "no-transform") == NULL)) {
+            // http_get_compression() skips already encoded and non-compressible types
+            http_comp = http_get_compression(&req, &res);
+        }
+        if (http_comp & COMPRESS) {
+            http_merge_vary(&res.hdr, "Accept-Encoding");
+            char *res_content_length = http_get_header_field(&res.hdr, "Content-Length");
+            if (rev_proxy_complete && rev_proxy_buf_len < compress_min_size) {
+                http_comp = 0;
+            } else if (!rev_proxy_complete && res_content_length != NULL &&
+                       strtoul(res_content_length, NULL, 10) < compress_min_size) {
+                http_comp = 0;
+            } else if (compress_incompressible(rev_proxy_buf, rev_proxy_buf_len)) {
+                http_comp = 0;
+            } else if (compress_dynamic_level(http_comp) < 0) {
+                http_comp = 0;
+            }
+        }
+
+        if (rev_proxy_complete) {
+            // whole body buffered, send it with an exact length
+            if (http_comp & COMPRESS) {
+                char *comp_buf = malloc(rev_proxy_buf_len);
+                long comp_len = -1;
+                if (comp_buf != NULL) {
+                    comp_len = compress_buffer(http_comp, rev_proxy_buf, rev_proxy_buf_len, comp_buf, rev_proxy_buf_len);
+                }
+                if (comp_len > 0) {
+                    free(rev_proxy_buf);
+                    rev_proxy_buf = comp_buf;
+                    rev_proxy_buf_len = comp_len;
+                    rev_proxy_comp = http_comp;
+                } else {
+                    free(comp_buf);
+                }
+            }
+            http_remove_header_field(&res.hdr, "Content-Length", HTTP_REMOVE_ALL);
+            http_remove_header_field(&res.hdr, "Transfer-Encoding", HTTP_REMOVE_ALL);
+            sprintf(buf0, "%li", rev_proxy_buf_len);
+            http_add_header_field(&res.hdr, "Content-Length", buf0);
+        } else if (http_comp & COMPRESS) {
             if (http_comp & COMPRESS_BR) {
                 use_rev_proxy |= REV_PROXY_COMPRESS_BR;
+            } else if (http_comp & COMPRESS_ZSTD) {
+                use_rev_proxy |= REV_PROXY_COMPRESS_ZSTD;
             } else if (http_comp & COMPRESS_GZ) {
                 use_rev_proxy |= REV_PROXY_COMPRESS_GZ;
             }
+            rev_proxy_comp = http_comp;
+
+            // the upstream length and framing are consumed by rev_proxy_send(), the client gets chunks
+            http_remove_header_field(&res.hdr, "Content-Length", HTTP_REMOVE_ALL);
+            http_remove_header_field(&res.hdr, "Transfer-Encoding", HTTP_REMOVE_ALL);
+            http_add_header_field(&res.hdr, "Transfer-Encoding", "chunked");
         }
 
-        char *transfer_encoding = http_get_header_field(&res.hdr, "Transfer-Encoding");
-        int chunked = transfer_encoding != NULL && strcmp(transfer_encoding, "chunked") == 0;
-        http_remove_header_field(&res.hdr, "Transfer-Encoding", HTTP_REMOVE_ALL);
-        ret = sprintf(buf0, "%s%s%s",
-                      (use_rev_proxy & REV_PROXY_COMPRESS_BR) ? "br" :
-                      ((use_rev_proxy & REV_PROXY_COMPRESS_GZ) ? "gzip" : ""),
-                      ((use_rev_proxy & REV_PROXY_COMPRESS) && chunked) ? ", " : "",
-                      chunked ? "chunked" : "");
-        if (ret > 0) {
-            http_add_header_field(&res.hdr, "Transfer-Encoding", buf0);
+        if (rev_proxy_comp) {
+            http_add_header_field(&res.hdr, "Content-Encoding", (rev_proxy_comp & COMPRESS_BR) ? "br" :
+                                  (rev_proxy_comp & COMPRESS_ZSTD) ? "zstd" : "gzip");
+
+            // a different content coding is a different representation
+            char *etag = http_get_header_field(&res.hdr, "ETag");
+            if (etag != NULL && etag[0] == '"') {
+                snprintf(buf1, sizeof(buf1), "W/%s", etag);
+                http_remove_header_field(&res.hdr, "ETag", HTTP_REMOVE_ALL);
+                http_add_header_field(&res.hdr, "ETag", buf1);
+            }
         }
-        */
     } else {
         print(ERR_STR "Unknown host type: %i" CLR_STR, conf->type);
         res.status = http_get_status(501);
@@ -544,37 +801,36 @@ int client_request_handler(sock *client, unsigned long client_num, unsigned int
                 print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
             }
             snd_len += ret;
+        } else if (file != NULL && range_num > 1) {
+            for (int i = 0; i < range_num; i++) {
+                ret = sock_send(client, range_hdr[i], range_hdr_len[i], MSG_MORE);
+                if (ret <= 0) break;
+                ret = sock_send_file(client, fileno(file), ranges[i].start, ranges[i].end - ranges[i].start + 1,
+                                     buffer, CHUNK_SIZE, MSG_MORE);
+                if (ret < 0) break;
+            }
+            if (ret > 0) {
+                len = sprintf(buf0, "\r\n--%s--\r\n", boundary);
+                ret = sock_send(client, buf0, len, 0);
+            }
+            if (ret <= 0) {
+                print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
+            }
         } else if (file != NULL) {
-            while (snd_len < content_length) {
-                len = fread(buffer, 1, CHUNK_SIZE, file);
-                if (snd_len + len > content_length) {
-                    len = content_length - snd_len;
-                }
-                ret = sock_send(client, buffer, len, feof(file) ? 0 : MSG_MORE);
-                if (ret <= 0) {
-                    print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
-                    break;
-                }
-                snd_len += ret;
+            ret = sock_send_file(client, fileno(file), file_off, content_length, buffer, CHUNK_SIZE, 0);
+            if (ret < 0) {
+                print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
             }
-        } else if (use_fastcgi) {
+        } else if (use_fastcgi && content_length != 0) {
+            // nothing to send for 204/304 and empty buffered bodies
             char *transfer_encoding = http_get_header_field(&res.hdr, "Transfer-Encoding");
             int chunked = transfer_encoding != NULL && strcmp(transfer_encoding, "chunked") == 0;
 
             int flags = (chunked ? FASTCGI_CHUNKED : 0) | (use_fastcgi & FASTCGI_COMPRESS);
             fastcgi_send(&php_fpm, client, flags);
         } else if (use_rev_proxy) {
-            char *transfer_encoding = http_get_header_field(&res.hdr, "Transfer-Encoding");
-            int chunked = transfer_encoding != NULL && strstr(transfer_encoding, "chunked") != NULL;
-
-            char *content_len = http_get_header_field(&res.hdr, "Content-Length");
-            unsigned long len_to_send = 0;
-            if (content_len != NULL) {
-                len_to_send = strtol(content_len, NULL, 10);
-            }
-
-            int flags = (chunked ? REV_PROXY_CHUNKED : 0) | (use_rev_proxy & REV_PROXY_COMPRESS);
-            rev_proxy_send(client, len_to_send, flags);
+            int flags = (rev_proxy_chunked ? REV_PROXY_CHUNKED : 0) | (use_rev_proxy & REV_PROXY_COMPRESS);
+            rev_proxy_send(client, rev_proxy_len, flags, rev_proxy_buf, rev_proxy_buf_len);
         }
     }
 
@@ -583,12 +839,17 @@ int client_request_handler(sock *client, unsigned long client_num, unsigned int
         sock_close(&rev_proxy);
     }
 
+    if (file != NULL) {
+        fclose(file);
+    }
+
     clock_gettime(CLOCK_MONOTONIC, &end);
     micros = (end.tv_nsec - begin.tv_nsec) / 1000 + (end.tv_sec - begin.tv_sec) * 1000000;
     print("Transfer complete: %s", format_duration(micros, buf0));
 
     uri_free(&uri);
     abort:
+    free(rev_proxy_buf);
     if (php_fpm.socket != 0) {
         shutdown(php_fpm.socket, SHUT_RDWR);
         close(php_fpm.socket);
@@ -5,22 +5,54 @@
  * Lorenz Stechauner, 2020-12-19
  */
 
+#define _GNU_SOURCE
+
 #include "cache.h"
+#include "config.h"
 #include "utils.h"
 #include "compress.h"
+#include "http.h"
 #include <stdio.h>
 #include <magic.h>
-#include <sys/ipc.h>
-#include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
-#include <openssl/sha.h>
+#include <openssl/evp.h>
+#include <libdeflate.h>
 #include <malloc.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <time.h>
+#include <sched.h>
 
 int cache_continue = 1;
 magic_t magic;
-cache_entry *cache;
+const EVP_MD *cache_md;
+cache_entry *cache, *cache_rw;
+int *cache_index, *cache_index_rw;
+unsigned int cache_index_size;
+cache_type *cache_types, *cache_types_rw;
+char *cache_arena, *cache_arena_rw;
+unsigned long cache_arena_size;
+cache_blob *cache_blobs;
+cache_state *cache_st;
+cache_neg *cache_negs;
+void *cache_map, *cache_map_rw;
+unsigned long cache_map_size;
+int cache_jobs = 0, cache_num_threads = 1;
+int cache_warm_request = 0, cache_warming = 0, cache_stats_request = 0;
+int cache_event_fd;
+cache_task *cache_queue_head = NULL, *cache_queue_tail = NULL;
+pthread_mutex_t cache_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cache_queue_cond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t cache_blob_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 int magic_init() {
     magic = magic_open(MAGIC_MIME);
@@ -35,177 +67,1445 @@ int magic_init() {
     return 0;
 }
 
+unsigned long cache_hash(const char *filename) {
+    // FNV-1a
+    unsigned long hash = 0xcbf29ce484222325;
+    for (const unsigned char *ptr = (const unsigned char *) filename; *ptr != 0; ptr++) {
+        hash ^= *ptr;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+unsigned int cache_entry_checksum(const cache_entry *entry) {
+    // FNV-1a over the persistent fields
+    unsigned int checksum = 0x811c9dc5;
+    const unsigned char *ptr = (const unsigned char *) cache_arena_rw + entry->path;
+    for (int i = 0; i < entry->path_len; i++) {
+        checksum = (checksum ^ ptr[i]) * 0x01000193;
+    }
+    unsigned long fields[] = {entry->path_len, entry->webroot_len, entry->type, entry->sidecar, entry->blob,
+                              entry->ino, entry->size, entry->mtime.tv_sec, entry->mtime.tv_nsec};
+    ptr = (const unsigned char *) fields;
+    for (int i = 0; i < sizeof(fields); i++) {
+        checksum = (checksum ^ ptr[i]) * 0x01000193;
+    }
+    ptr = (const unsigned char *) entry->etag;
+    for (int i = 0; i < sizeof(entry->etag) && ptr[i] != 0; i++) {
+        checksum = (checksum ^ ptr[i]) * 0x01000193;
+    }
+    return checksum;
+}
+
+int cache_entry_valid(const cache_entry *entry) {
+    // only called with the entry locked
+    return entry->path_len < CACHE_PATH_SIZE && entry->path + entry->path_len < cache_arena_size &&
+           cache_arena_rw[entry->path + entry->path_len] == 0 && cache_types_rw[entry->type].type[0] != 0 &&
+           entry->checksum == cache_entry_checksum(entry);
+}
+
+int cache_seq_wait(const unsigned int *seq, unsigned int *val) {
+    // waits for an even sequence number; a process terminated while writing leaves it odd forever,
+    // so give up after the same odd number was seen for CACHE_LOCK_TIMEOUT milliseconds
+    unsigned int s, prev = 0;
+    struct timespec begin = {0}, now;
+    for (int n = 0; (s = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1; n++) {
+        if (n < CACHE_LOCK_SPINS) continue;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        if (n == CACHE_LOCK_SPINS || s != prev) {
+            begin = now;
+            prev = s;
+        } else if ((now.tv_sec - begin.tv_sec) * 1000 + (now.tv_nsec - begin.tv_nsec) / 1000000 >=
+                   CACHE_LOCK_TIMEOUT) {
+            *val = s;
+            return -1;
+        }
+        sched_yield();
+    }
+    *val = s;
+    return 0;
+}
+
+int cache_get_entry(const char *filename, unsigned long hash) {
+    unsigned int seq;
+    int ret;
+    do {
+        // a miss is only trusted if the index has not been written to in the meantime
+        ret = -1;
+        if (cache_seq_wait(&cache_st->index_seq, &seq) != 0) {
+            if (cache_index_lock_broken(seq) == 0) cache_index_unlock();
+            continue;
+        }
+        unsigned long slot = hash;
+        for (int n = 0; n < cache_index_size; n++, slot++) {
+            int entry_num = __atomic_load_n(&cache_index[slot & (cache_index_size - 1)], __ATOMIC_RELAXED) - 1;
+            if (entry_num == -1) {
+                break;
+            } else if (entry_num < 0) {
+                // removed entry, continue probing
+                continue;
+            } else if (cache[entry_num].hash == hash && cache_entry_read(entry_num, filename, NULL) == 0) {
+                ret = entry_num;
+                break;
+            }
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (ret < 0 && __atomic_load_n(&cache_st->index_seq, __ATOMIC_RELAXED) != seq);
+    return ret;
+}
+
+void cache_entry_lock(int entry_num) {
+    // seqlock: an odd sequence number marks an entry as being written
+    cache_entry *entry = &cache_rw[entry_num];
+    unsigned int s;
+    while (1) {
+        if (cache_seq_wait(&entry->seq, &s) == 0) {
+            if (__atomic_compare_exchange_n(&entry->seq, &s, s + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+        } else if (cache_entry_lock_broken(entry_num, s) == 0) {
+            break;
+        }
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+int cache_entry_lock_broken(int entry_num, unsigned int seq) {
+    // the writer was terminated: take over its lock and drop what it may have left half-written
+    cache_entry *entry = &cache_rw[entry_num];
+    if (!__atomic_compare_exchange_n(&entry->seq, &seq, seq + 2, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        // taken over by another process
+        return -1;
+    }
+    fprintf(stderr, ERR_STR "Cache entry %i was left locked" CLR_STR "\n", entry_num);
+    if (entry->path_len != 0 && !cache_entry_valid(entry)) {
+        cache_index_remove(entry_num);
+        cache_entry_clear(entry_num);
+    }
+    return 0;
+}
+
+void cache_entry_unlock(int entry_num) {
+    __atomic_add_fetch(&cache_rw[entry_num].seq, 1, __ATOMIC_RELEASE);
+}
+
+void cache_entry_clear(int entry_num) {
+    // keep the sequence number, readers must notice the change
+    cache_entry *entry = &cache_rw[entry_num];
+    if (entry->path_len != 0) {
+        __atomic_add_fetch(&cache_st->arena_dead, entry->path_len + 1, __ATOMIC_RELAXED);
+    }
+    memset((char *) entry + sizeof(entry->seq), 0, sizeof(cache_entry) - sizeof(entry->seq));
+}
+
+int cache_entry_claim(int entry_num) {
+    // free entries are reserved before a path is stored, workers and the warm-up compete for them
+    cache_entry *entry = &cache_rw[entry_num];
+    int ret = -1;
+    cache_entry_lock(entry_num);
+    if (entry->path_len == 0 && !entry->is_updating) {
+        entry->is_updating = 1;
+        ret = 0;
+    }
+    cache_entry_unlock(entry_num);
+    return ret;
+}
+
+int cache_entry_match(int entry_num, const char *filename, const struct stat *statbuf) {
+    // only called with the entry locked
+    const cache_entry *entry = &cache_rw[entry_num];
+    unsigned long len = strlen(filename);
+    if (entry->path_len != len || entry->path + len >= cache_arena_size ||
+            memcmp(cache_arena_rw + entry->path, filename, len) != 0) {
+        return 0;
+    }
+    return statbuf == NULL || (entry->ino == statbuf->st_ino && entry->size == statbuf->st_size &&
+                               memcmp(&entry->mtime, &statbuf->st_mtim, sizeof(entry->mtime)) == 0);
+}
+
+int cache_entry_read(int entry_num, const char *filename, meta_data *meta) {
+    const cache_entry *entry = &cache[entry_num];
+    unsigned long len = strlen(filename);
+    unsigned int seq;
+    int match, blob;
+    cache_entry snapshot;
+    do {
+        if (cache_seq_wait(&entry->seq, &seq) != 0) {
+            if (cache_entry_lock_broken(entry_num, seq) == 0) cache_entry_unlock(entry_num);
+            match = 0;
+            continue;
+        }
+        match = entry->path_len == len && entry->path + len < cache_arena_size &&
+                memcmp(cache_arena + entry->path, filename, len) == 0;
+        if (meta != NULL) {
+            memcpy(&snapshot, entry, sizeof(cache_entry));
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq);
+    if (!match) {
+        return -1;
+    } else if (meta == NULL) {
+        return 0;
+    }
+
+    memset(meta, 0, sizeof(meta_data));
+    meta->stat.st_ino = snapshot.ino;
+    meta->stat.st_size = snapshot.size;
+    meta->stat.st_mtim = snapshot.mtime;
+    strcpy(meta->type, cache_types[snapshot.type].type);
+    strcpy(meta->charset, cache_types[snapshot.type].charset);
+    snprintf(meta->etag, sizeof(meta->etag), "%.*s", (int) sizeof(snapshot.etag) - 1, snapshot.etag);
+    blob = snapshot.blob;
+    if (blob > 0 && meta->etag[0] != 0) {
+        // compressed files are addressed by content
+        cache_blob_filename(meta->filename_comp_gz, sizeof(meta->filename_comp_gz), meta->etag, "gz");
+        cache_blob_filename(meta->filename_comp_br, sizeof(meta->filename_comp_br), meta->etag, "br");
+        cache_blob_filename(meta->filename_comp_zst, sizeof(meta->filename_comp_zst), meta->etag, "zst");
+    }
+    // precompressed files from the build take precedence, they are usable before hashing
+    if (snapshot.sidecar & COMPRESS_GZ) {
+        snprintf(meta->filename_comp_gz, sizeof(meta->filename_comp_gz), "%s.gz", filename);
+    }
+    if (snapshot.sidecar & COMPRESS_BR) {
+        snprintf(meta->filename_comp_br, sizeof(meta->filename_comp_br), "%s.br", filename);
+    }
+    if (snapshot.sidecar & COMPRESS_ZSTD) {
+        snprintf(meta->filename_comp_zst, sizeof(meta->filename_comp_zst), "%s.zst", filename);
+    }
+    return 0;
+}
+
+int cache_entry_path(int entry_num, char *buf) {
+    const cache_entry *entry = &cache[entry_num];
+    unsigned int seq;
+    int len;
+    do {
+        if (cache_seq_wait(&entry->seq, &seq) != 0) {
+            if (cache_entry_lock_broken(entry_num, seq) == 0) cache_entry_unlock(entry_num);
+            len = 0;
+            continue;
+        }
+        len = entry->path_len;
+        if (len >= CACHE_PATH_SIZE || entry->path + len >= cache_arena_size) len = 0;
+        memcpy(buf, cache_arena + entry->path, len);
+        buf[len] = 0;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq);
+    return len > 0 ? len : -1;
+}
+
+int cache_type_get(const char *type, const char *charset) {
+    int ret = 0;
+    while (__atomic_exchange_n(&cache_st->arena_lock, 1, __ATOMIC_ACQUIRE));
+    for (int i = 1; i < CACHE_TYPES; i++) {
+        cache_type *t = &cache_types_rw[i];
+        if (t->type[0] == 0) {
+            snprintf(t->type, sizeof(t->type), "%s", type);
+            snprintf(t->charset, sizeof(t->charset), "%s", charset);
+            ret = i;
+            break;
+        } else if (strncmp(t->type, type, sizeof(t->type) - 1) == 0 &&
+                   strncmp(t->charset, charset, sizeof(t->charset) - 1) == 0) {
+            ret = i;
+            break;
+        }
+    }
+    __atomic_store_n(&cache_st->arena_lock, 0, __ATOMIC_RELEASE);
+    // table full: 0 is always application/octet-stream
+    return ret;
+}
+
+void cache_file_type(const char *filename, char *type, char *charset) {
+    // request path: extension only, an empty charset is detected later by the updater
+    const http_mime_type *mime = http_get_mime_type(filename);
+    snprintf(type, 32, "%s", mime != NULL ? mime->type : "application/octet-stream");
+    snprintf(charset, 16, "%s", mime != NULL && mime->charset != NULL ? mime->charset : "");
+}
+
+void cache_magic_type(const char *filename, char *type, char *charset) {
+    // libmagic is slow and not thread-safe, only used by the updater's main thread
+    if (http_get_mime_type(filename) == NULL) {
+        magic_setflags(magic, MAGIC_MIME_TYPE);
+        const char *magic_type = magic_file(magic, filename);
+        snprintf(type, 32, "%s", magic_type != NULL ? magic_type : "application/octet-stream");
+    }
+    magic_setflags(magic, MAGIC_MIME_ENCODING);
+    const char *magic_charset = magic_file(magic, filename);
+    snprintf(charset, 16, "%s", magic_charset != NULL ? magic_charset : "binary");
+}
+
+int cache_arena_alloc(const char *str, unsigned long len) {
+    // the caller has to decrement arena_pending after storing the offset in its entry
+    int off = -1;
+    unsigned long event = 1;
+    while (__atomic_exchange_n(&cache_st->arena_lock, 1, __ATOMIC_ACQUIRE));
+    if (cache_st->arena_tail + len + 1 <= cache_arena_size) {
+        off = (int) cache_st->arena_tail;
+        memcpy(cache_arena_rw + off, str, len + 1);
+        cache_st->arena_tail += len + 1;
+        __atomic_add_fetch(&cache_st->arena_pending, 1, __ATOMIC_ACQ_REL);
+    }
+    int compact = cache_st->arena_tail > cache_arena_size / 4 * 3 && cache_st->arena_dead > cache_arena_size / 4;
+    __atomic_store_n(&cache_st->arena_lock, 0, __ATOMIC_RELEASE);
+    if (off < 0 || compact) {
+        __atomic_store_n(&cache_st->arena_compact, 1, __ATOMIC_RELEASE);
+        write(cache_event_fd, &event, sizeof(event));
+    }
+    return off;
+}
+
+int cache_arena_compact() {
+    // slide all live paths to the beginning of the arena, in ascending order
+    while (__atomic_exchange_n(&cache_st->arena_lock, 1, __ATOMIC_ACQUIRE));
+    if (__atomic_load_n(&cache_st->arena_pending, __ATOMIC_ACQUIRE) != 0) {
+        // allocated paths are not yet referenced by their entries, try again later
+        __atomic_store_n(&cache_st->arena_lock, 0, __ATOMIC_RELEASE);
+        return -1;
+    }
+
+    unsigned int off = 0;
+    int *order = malloc(cache_entries * sizeof(int));
+    int num = 0;
+    for (int i = 0; i < cache_entries; i++) {
+        if (cache_rw[i].path_len != 0) order[num++] = i;
+    }
+    for (int i = 1; i < num; i++) {
+        // insertion sort, mostly sorted already
+        int e = order[i], j = i - 1;
+        for (; j >= 0 && cache_rw[order[j]].path > cache_rw[e].path; j--) order[j + 1] = order[j];
+        order[j + 1] = e;
+    }
+    for (int i = 0; i < num; i++) {
+        cache_entry *entry = &cache_rw[order[i]];
+        if (entry->path != off) {
+            cache_entry_lock(order[i]);
+            memmove(cache_arena_rw + off, cache_arena_rw + entry->path, entry->path_len + 1);
+            entry->path = off;
+            cache_entry_unlock(order[i]);
+        }
+        off += entry->path_len + 1;
+    }
+    free(order);
+
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    unsigned long free_off = (off + page - 1) / page * page;
+    if (free_off < cache_st->arena_tail) {
+        // give the pages back
+        madvise(cache_arena_rw + free_off, (cache_st->arena_tail - free_off + page - 1) / page * page, MADV_REMOVE);
+    }
+    cache_st->arena_tail = off;
+    cache_st->arena_dead = 0;
+    __atomic_store_n(&cache_st->arena_lock, 0, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void cache_index_lock() {
+    // workers and the updater modify the index concurrently, same seqlock as for entries
+    unsigned int *seq = &cache_st->index_seq;
+    unsigned int s;
+    while (1) {
+        if (cache_seq_wait(seq, &s) == 0) {
+            if (__atomic_compare_exchange_n(seq, &s, s + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+        } else if (cache_index_lock_broken(s) == 0) {
+            break;
+        }
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+int cache_index_lock_broken(unsigned int seq) {
+    // the writer was terminated: take over its lock; slots are written atomically, at worst entries dropped
+    // by an interrupted compaction are missed and added again
+    if (!__atomic_compare_exchange_n(&cache_st->index_seq, &seq, seq + 2, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    fprintf(stderr, ERR_STR "File cache index was left locked" CLR_STR "\n");
+    return 0;
+}
+
+void cache_index_unlock() {
+    __atomic_add_fetch(&cache_st->index_seq, 1, __ATOMIC_RELEASE);
+}
+
+void cache_index_put(int entry_num) {
+    // only called with the index locked
+    unsigned long slot = cache_rw[entry_num].hash;
+    for (int n = 0; n < cache_index_size; n++, slot++) {
+        int *ptr = &cache_index_rw[slot & (cache_index_size - 1)];
+        if (*ptr <= 0) {
+            if (*ptr < 0) cache_st->index_dead--;
+            __atomic_store_n(ptr, entry_num + 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+}
+
+void cache_index_insert(int entry_num) {
+    cache_index_lock();
+    cache_index_put(entry_num);
+    cache_index_unlock();
+}
+
+void cache_index_remove(int entry_num) {
+    unsigned long event = 1;
+    int compact = 0;
+    unsigned long slot = cache_rw[entry_num].hash;
+    cache_index_lock();
+    for (int n = 0; n < cache_index_size; n++, slot++) {
+        int *ptr = &cache_index_rw[slot & (cache_index_size - 1)];
+        if (*ptr == 0) {
+            break;
+        } else if (*ptr == entry_num + 1) {
+            __atomic_store_n(ptr, -1, __ATOMIC_RELAXED);
+            // removed entries are never reclaimed by inserts alone, probe chains would only grow
+            compact = ++cache_st->index_dead > cache_index_size / 4;
+            break;
+        }
+    }
+    cache_index_unlock();
+    if (compact) {
+        __atomic_store_n(&cache_st->index_compact, 1, __ATOMIC_RELEASE);
+        write(cache_event_fd, &event, sizeof(event));
+    }
+}
+
+void cache_index_compact() {
+    // reinsert exactly the indexed entries, entries not yet inserted by a worker must stay out
+    int *entries = malloc(cache_index_size * sizeof(int));
+    int num = 0;
+    cache_index_lock();
+    for (int i = 0; i < cache_index_size; i++) {
+        if (cache_index_rw[i] > 0) entries[num++] = cache_index_rw[i] - 1;
+    }
+    memset(cache_index_rw, 0, cache_index_size * sizeof(int));
+    cache_st->index_dead = 0;
+    for (int i = 0; i < num; i++) {
+        cache_index_put(entries[i]);
+    }
+    cache_index_unlock();
+    free(entries);
+}
+
+void cache_index_rebuild() {
+    memset(cache_index_rw, 0, cache_index_size * sizeof(int));
+    cache_st->index_dead = 0;
+    for (int i = 0; i < cache_entries; i++) {
+        if (cache_rw[i].path_len != 0) {
+            cache_rw[i].hash = cache_hash(cache_arena_rw + cache_rw[i].path);
+            cache_index_put(i);
+        }
+    }
+}
+
+int cache_blob_filename(char *buf, unsigned long size, const char *hash, const char *ext) {
+    int len = snprintf(buf, size, "%s/%.2s/%s.%s", cache_dir, hash, hash, ext);
+    return (len < 0 || len >= size) ? -1 : 0;
+}
+
+int cache_blob_acquire(const char *hash) {
+    // only called by the updater with cache_blob_mutex locked
+    unsigned long slot = cache_hash(hash);
+    int free_slot = -1;
+    for (int n = 0; n < cache_index_size; n++, slot++) {
+        int i = (int) (slot & (cache_index_size - 1));
+        if (cache_blobs[i].hash[0] == 0) {
+            if (free_slot < 0) free_slot = i;
+            break;
+        } else if (strcmp(cache_blobs[i].hash, hash) == 0) {
+            __atomic_add_fetch(&cache_blobs[i].refs, 1, __ATOMIC_ACQ_REL);
+            return i;
+        } else if (free_slot < 0 && __atomic_load_n(&cache_blobs[i].refs, __ATOMIC_ACQUIRE) == 0) {
+            // unreferenced slots keep their hash until reused, so probe chains stay intact
+            free_slot = i;
+        }
+    }
+    if (free_slot < 0) {
+        return -1;
+    }
+
+    cache_blob *blob = &cache_blobs[free_slot];
+    if (blob->hash[0] != 0 && blob->ready) {
+        char buf[256];
+        if (cache_blob_filename(buf, sizeof(buf), blob->hash, "gz") == 0) unlink(buf);
+        if (cache_blob_filename(buf, sizeof(buf), blob->hash, "br") == 0) unlink(buf);
+        if (cache_blob_filename(buf, sizeof(buf), blob->hash, "zst") == 0) unlink(buf);
+    }
+    strcpy(blob->hash, hash);
+    blob->ready = 0;
+    __atomic_store_n(&blob->refs, 1, __ATOMIC_RELEASE);
+    return free_slot;
+}
+
+void cache_blob_release(int blob) {
+    if (blob >= 0 && __atomic_sub_fetch(&cache_blobs[blob].refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        // let the updater remove the compressed files
+        unsigned long event = 1;
+        __atomic_store_n(&cache_st->blob_gc, 1, __ATOMIC_RELEASE);
+        write(cache_event_fd, &event, sizeof(event));
+    }
+}
+
+void cache_blob_gc() {
+    char buf[256];
+    pthread_mutex_lock(&cache_blob_mutex);
+    for (int i = 0; i < cache_index_size; i++) {
+        cache_blob *blob = &cache_blobs[i];
+        if (blob->hash[0] == 0 || !blob->ready || __atomic_load_n(&blob->refs, __ATOMIC_ACQUIRE) != 0) {
+            continue;
+        }
+        fprintf(stdout, "[cache] Removing compressed files of %s\n", blob->hash);
+        if (cache_blob_filename(buf, sizeof(buf), blob->hash, "gz") == 0) unlink(buf);
+        if (cache_blob_filename(buf, sizeof(buf), blob->hash, "br") == 0) unlink(buf);
+        if (cache_blob_filename(buf, sizeof(buf), blob->hash, "zst") == 0) unlink(buf);
+        blob->ready = 0;
+    }
+    pthread_mutex_unlock(&cache_blob_mutex);
+}
+
+unsigned long cache_neg_key(const char *prefix, const char *path) {
+    // FNV-1a over prefix and path, without query
+    unsigned long hash = 0xcbf29ce484222325;
+    for (const unsigned char *ptr = (const unsigned char *) prefix; *ptr != 0; ptr++) {
+        hash ^= *ptr;
+        hash *= 0x100000001b3;
+    }
+    for (const unsigned char *ptr = (const unsigned char *) path; *ptr != 0 && *ptr != '?'; ptr++) {
+        hash ^= *ptr;
+        hash *= 0x100000001b3;
+    }
+    // 0 marks an empty slot
+    return hash != 0 ? hash : 1;
+}
+
+int cache_neg_lookup(const char *prefix, const char *path) {
+    if (cache_neg_ttl == 0) {
+        return 0;
+    }
+    unsigned long hash = cache_neg_key(prefix, path);
+    cache_neg *neg = &cache_negs[hash & (CACHE_NEG_SIZE - 1)];
+    if (__atomic_load_n(&neg->hash, __ATOMIC_ACQUIRE) != hash) {
+        return 0;
+    }
+    unsigned int gen = __atomic_load_n(&neg->gen, __ATOMIC_RELAXED);
+    unsigned int expires = __atomic_load_n(&neg->expires, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&neg->hash, __ATOMIC_ACQUIRE) != hash) {
+        // replaced in the meantime
+        return 0;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    if (gen != __atomic_load_n(&cache_st->neg_gen, __ATOMIC_ACQUIRE) || expires <= now.tv_sec) {
+        return 0;
+    }
+    __atomic_add_fetch(&cache_st->neg_hits, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+void cache_neg_store(const char *prefix, const char *path) {
+    if (cache_neg_ttl == 0) {
+        return;
+    }
+    unsigned long hash = cache_neg_key(prefix, path);
+    cache_neg *neg = &cache_negs[hash & (CACHE_NEG_SIZE - 1)];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+    // direct mapped, newer paths replace older ones
+    __atomic_store_n(&neg->hash, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&neg->gen, __atomic_load_n(&cache_st->neg_gen, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+    __atomic_store_n(&neg->expires, (unsigned int) now.tv_sec + cache_neg_ttl, __ATOMIC_RELAXED);
+    __atomic_store_n(&neg->hash, hash, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&cache_st->neg_stores, 1, __ATOMIC_RELAXED);
+}
+
+void cache_neg_remove(const char *prefix, const char *path) {
+    unsigned long hash = cache_neg_key(prefix, path);
+    cache_neg *neg = &cache_negs[hash & (CACHE_NEG_SIZE - 1)];
+    __atomic_compare_exchange_n(&neg->hash, &hash, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+void cache_neg_flush() {
+    // invalidates all negative entries at once
+    __atomic_add_fetch(&cache_st->neg_gen, 1, __ATOMIC_ACQ_REL);
+}
+
 void cache_process_term() {
+    unsigned long event = 1;
     cache_continue = 0;
+    write(cache_event_fd, &event, sizeof(event));
 }
 
-int cache_process() {
-    signal(SIGINT, cache_process_term);
-    signal(SIGTERM, cache_process_term);
+void cache_process_warm() {
+    unsigned long event = 1;
+    cache_warm_request = 1;
+    write(cache_event_fd, &event, sizeof(event));
+}
+
+void cache_process_flush() {
+    // webroots have changed, previously missing paths may exist now
+    cache_neg_flush();
+}
 
-    int shm_id = shmget(CACHE_SHM_KEY, CACHE_ENTRIES * sizeof(cache_entry), 0);
-    if (shm_id < 0) {
-        fprintf(stderr, ERR_STR "Unable to create shared memory: %s" CLR_STR "\n", strerror(errno));
+void cache_process_stats() {
+    unsigned long event = 1;
+    cache_stats_request = 1;
+    write(cache_event_fd, &event, sizeof(event));
+}
+
+void cache_request_update(int entry_num) {
+    unsigned long event = 1;
+    unsigned int head, tail;
+    cache_rw[entry_num].hits = 0;
+    do {
+        tail = __atomic_load_n(&cache_st->queue_tail, __ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&cache_st->queue_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= CACHE_QUEUE_SIZE) {
+            // ring full, updater has to scan all entries
+            __atomic_store_n(&cache_st->queue_overflow, 1, __ATOMIC_RELEASE);
+            write(cache_event_fd, &event, sizeof(event));
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&cache_st->queue_tail, &tail, tail + 1, 0,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    __atomic_store_n(&cache_st->queue[tail % CACHE_QUEUE_SIZE], entry_num + 1, __ATOMIC_RELEASE);
+    write(cache_event_fd, &event, sizeof(event));
+}
+
+int cache_job_open(cache_job *job) {
+    if (cache_entry_path(job->entry_num, job->filename) < 0) {
         return -1;
     }
+    cache_entry *entry = &cache_rw[job->entry_num];
+    strcpy(job->type, cache_types[entry->type].type);
+    if (cache_types[entry->type].charset[0] == 0) {
+        // unknown extension or text file: detect type and charset asynchronously
+        char charset[16];
+        cache_magic_type(job->filename, job->type, charset);
+        int type_id = cache_type_get(job->type, charset);
+        cache_entry_lock(job->entry_num);
+        entry->type = (unsigned char) type_id;
+        entry->checksum = cache_entry_checksum(entry);
+        cache_entry_unlock(job->entry_num);
+    }
 
-    shmdt(cache);
-    void *shm_rw = shmat(shm_id, NULL, 0);
-    if (shm_rw == (void *) -1) {
-        fprintf(stderr, ERR_STR "Unable to attach shared memory (rw): %s" CLR_STR "\n", strerror(errno));
-        return -2;
+    int fd = open(job->filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, ERR_STR "Unable to open file %s: %s" CLR_STR "\n", job->filename, strerror(errno));
+        return -1;
+    }
+    struct stat statbuf;
+    fstat(fd, &statbuf);
+    cache_entry_lock(job->entry_num);
+    int stale = !cache_entry_match(job->entry_num, job->filename, &statbuf);
+    job->sidecar = entry->sidecar;
+    if (job->refine && entry->blob != job->blob + 1) {
+        // the refined files are stored under the entry's hash, it has to be the hash of this file
+        stale = 1;
+    }
+    cache_entry_unlock(job->entry_num);
+    if (stale) {
+        // the entry describes another version of the file, it is updated with the next request
+        close(fd);
+        return 1;
     }
-    cache = shm_rw;
+    job->stat = statbuf;
+    job->size = statbuf.st_size;
+    // kept open for hashing and compressing; the file is read, not mapped, because a concurrent truncate
+    // would raise SIGBUS when accessing the mapping
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    job->fd = fd;
 
-    if (mkdir("/var/necronda-server/", 0755) < 0) {
-        if (errno != EEXIST) {
-            fprintf(stderr, ERR_STR "Unable to create directory '/var/necronda-server/': %s" CLR_STR "\n", strerror(errno));
-            return -3;
+    // nothing to do if the build already provides all compressed files
+    job->compress = mime_is_compressible(job->type) && (job->sidecar & COMPRESS) != COMPRESS;
+    return 0;
+}
+
+int cache_job_read(cache_job *job, char *buf, unsigned long off, unsigned long len) {
+    for (unsigned long pos = 0; pos < len;) {
+        long n = pread(job->fd, buf + pos, len - pos, (long) (off + pos));
+        if (n <= 0) {
+            fprintf(stderr, ERR_STR "Unable to read file %s: %s" CLR_STR "\n", job->filename,
+                    n == 0 ? "File was truncated" : strerror(errno));
+            return -1;
         }
+        pos += n;
+    }
+    return 0;
+}
+
+int cache_job_hash(cache_job *job, int block) {
+    unsigned long off = (unsigned long) block * CACHE_HASH_BLOCK_SIZE;
+    unsigned long len = (job->size - off < CACHE_HASH_BLOCK_SIZE) ? job->size - off : CACHE_HASH_BLOCK_SIZE;
+    int ret = -1;
+
+    if (block == 0) {
+        fprintf(stdout, "[cache] Hashing file %s\n", job->filename);
+    }
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    char *buf = malloc(CACHE_BUF_SIZE);
+    if (ctx == NULL || buf == NULL || EVP_DigestInit_ex(ctx, cache_md, NULL) != 1) {
+        fprintf(stderr, ERR_STR "Unable to hash file %s" CLR_STR "\n", job->filename);
+        goto end;
+    }
+    for (unsigned long pos = 0; pos < len;) {
+        unsigned long n = (len - pos < CACHE_BUF_SIZE) ? len - pos : CACHE_BUF_SIZE;
+        if (cache_job_read(job, buf, off + pos, n) != 0) {
+            goto end;
+        }
+        EVP_DigestUpdate(ctx, buf, n);
+        pos += n;
+    }
+    if (EVP_DigestFinal_ex(ctx, job->digests + block * EVP_MD_size(cache_md), NULL) != 1) {
+        fprintf(stderr, ERR_STR "Unable to hash file %s" CLR_STR "\n", job->filename);
+        goto end;
+    }
+    ret = 0;
+
+    end:
+    free(buf);
+    EVP_MD_CTX_free(ctx);
+    return ret;
+}
+
+int cache_job_hash_final(cache_job *job) {
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    int hash_len = EVP_MD_size(cache_md);
+
+    if (job->blocks == 1) {
+        memcpy(hash, job->digests, hash_len);
+    } else if (EVP_Digest(job->digests, job->blocks * hash_len, hash, NULL, cache_md, NULL) != 1) {
+        // tree hash: hash of all block hashes
+        fprintf(stderr, ERR_STR "Unable to hash file %s" CLR_STR "\n", job->filename);
+        return -1;
+    }
+    if (hash_len > 20) hash_len = 20;
+    memset(job->etag, 0, sizeof(job->etag));
+    for (int j = 0; j < hash_len; j++) {
+        sprintf(job->etag + j * 2, "%02x", hash[j]);
     }
+    fprintf(stdout, "[cache] Finished hashing file %s\n", job->filename);
+    return 0;
+}
 
-    FILE *cache_file = fopen("/var/necronda-server/cache", "rb");
-    if (cache_file != NULL) {
-        fread(cache, sizeof(cache_entry), CACHE_ENTRIES, cache_file);
-        fclose(cache_file);
+int cache_job_store(cache_job *job) {
+    char buf[256];
+    int ret = 0;
+
+    if (cache_blob_filename(job->filename_comp_gz, sizeof(job->filename_comp_gz), job->etag, "gz") != 0 ||
+            cache_blob_filename(job->filename_comp_br, sizeof(job->filename_comp_br), job->etag, "br") != 0 ||
+            cache_blob_filename(job->filename_comp_zst, sizeof(job->filename_comp_zst), job->etag, "zst") != 0) {
+        fprintf(stderr, ERR_STR "Unable to open cached file: File name for compressed file too long" CLR_STR "\n");
+        job->compress = 0;
+        return -1;
     }
 
-    for (int i = 0; i < CACHE_ENTRIES; i++) {
-        cache[i].is_updating = 0;
+    pthread_mutex_lock(&cache_blob_mutex);
+    job->blob = cache_blob_acquire(job->etag);
+    if (job->blob < 0) {
+        fprintf(stderr, ERR_STR "Unable to store compressed file: No free slot" CLR_STR "\n");
+        job->compress = 0;
+        ret = -1;
+    } else if (!cache_blobs[job->blob].ready ||
+            (!(job->sidecar & COMPRESS_GZ) && access(job->filename_comp_gz, F_OK) != 0) ||
+            (!(job->sidecar & COMPRESS_BR) && access(job->filename_comp_br, F_OK) != 0) ||
+            (!(job->sidecar & COMPRESS_ZSTD) && access(job->filename_comp_zst, F_OK) != 0)) {
+        cache_blobs[job->blob].ready = 0;
+        ret = 1;
+    } else {
+        fprintf(stdout, "[cache] Reusing compressed files of %s\n", job->etag);
     }
+    pthread_mutex_unlock(&cache_blob_mutex);
 
-    FILE *file;
-    char *buf = malloc(CACHE_BUF_SIZE);
+    if (ret == 1) {
+        strcpy(buf, job->filename_comp_gz);
+        strrchr(buf, '/')[0] = 0;
+        mkdir(buf, 0700);
+    }
+    return ret;
+}
+
+int cache_job_compress_oneshot(cache_job *job) {
+    // whole file in memory: libdeflate is considerably faster than streaming zlib at the same ratio
+    char filename_tmp[272];
+    struct libdeflate_compressor *compressor =
+            libdeflate_alloc_compressor(job->fast ? CACHE_FAST_LEVEL_GZIP : COMPRESS_LEVEL_GZIP);
+    if (compressor == NULL) {
+        fprintf(stderr, ERR_STR "Unable to init compression" CLR_STR "\n");
+        return -1;
+    }
+
+    fprintf(stdout, "[cache] Compressing file %s (gzip)\n", job->filename);
+    unsigned long size = libdeflate_gzip_compress_bound(compressor, job->size);
+    char *comp_buf = malloc(size);
+    char *buf = malloc(job->size + 1);
+    if (comp_buf == NULL || buf == NULL || cache_job_read(job, buf, 0, job->size) != 0) {
+        libdeflate_free_compressor(compressor);
+        free(comp_buf);
+        free(buf);
+        return -1;
+    }
+    unsigned long len = libdeflate_gzip_compress(compressor, buf, job->size, comp_buf, size);
+    libdeflate_free_compressor(compressor);
+    free(buf);
+    if (len == 0) {
+        fprintf(stderr, ERR_STR "Unable to compress file %s" CLR_STR "\n", job->filename);
+        free(comp_buf);
+        return -1;
+    }
+
+    sprintf(filename_tmp, "%s.%i.tmp", job->filename_comp_gz, job->entry_num);
+    FILE *comp_file = fopen(filename_tmp, "wb");
+    if (comp_file == NULL) {
+        fprintf(stderr, ERR_STR "Unable to open cached file: %s" CLR_STR "\n", strerror(errno));
+        free(comp_buf);
+        return -1;
+    }
+    fwrite(comp_buf, 1, len, comp_file);
+    free(comp_buf);
+    if (fclose(comp_file) != 0) {
+        fprintf(stderr, ERR_STR "Unable to write cached file: %s" CLR_STR "\n", strerror(errno));
+        unlink(filename_tmp);
+        return -1;
+    }
+
+    if (cache_job_commit(job, filename_tmp, job->filename_comp_gz) != 0) {
+        return -1;
+    }
+    fprintf(stdout, "[cache] Finished compressing file %s (gzip)\n", job->filename);
+    return 0;
+}
+
+int cache_job_compress(cache_job *job, int mode) {
+    if ((mode & COMPRESS_GZ) && job->size < CACHE_ONESHOT_SIZE) {
+        return cache_job_compress_oneshot(job);
+    }
+
+    const char *filename_comp = (mode & COMPRESS_ZSTD) ? job->filename_comp_zst :
+                                (mode & COMPRESS_BR) ? job->filename_comp_br : job->filename_comp_gz;
+    compress_ctx comp_ctx;
+    unsigned long off = 0;
+    char filename_tmp[272];
+
+    // write to a temporary file first, so that readers never see incomplete files
+    sprintf(filename_tmp, "%s.%i.tmp", filename_comp, job->entry_num);
+    FILE *comp_file = fopen(filename_tmp, "wb");
+    if (comp_file == NULL) {
+        fprintf(stderr, ERR_STR "Unable to open cached file: %s" CLR_STR "\n", strerror(errno));
+        return -1;
+    }
+    if (compress_init_level(&comp_ctx, mode, job->fast ? CACHE_FAST_LEVEL_GZIP : COMPRESS_LEVEL_GZIP,
+                            job->fast ? CACHE_FAST_LEVEL_BROTLI : COMPRESS_LEVEL_BROTLI,
+                            job->fast ? CACHE_FAST_LEVEL_ZSTD : COMPRESS_LEVEL_ZSTD) != 0) {
+        fprintf(stderr, ERR_STR "Unable to init compression: %s" CLR_STR "\n", strerror(errno));
+        fclose(comp_file);
+        return -1;
+    }
+
+    if ((mode & COMPRESS_ZSTD) && cache_num_threads > 1 && job->size >= CACHE_PAR_SIZE) {
+        // fails without effect if libzstd was built without multithreading support
+        ZSTD_CCtx_setParameter(comp_ctx.zstd, ZSTD_c_nbWorkers, cache_num_threads);
+        ZSTD_CCtx_setParameter(comp_ctx.zstd, ZSTD_c_jobSize, CACHE_PAR_BLOCK_SIZE);
+    }
+
+    fprintf(stdout, "[cache] Compressing file %s (%s)\n", job->filename,
+            (mode & COMPRESS_ZSTD) ? "zstd" : (mode & COMPRESS_BR) ? "br" : "gzip");
     char *comp_buf = malloc(CACHE_BUF_SIZE);
-    char filename_comp_gz[256];
-    char filename_comp_br[256];
-    unsigned long read;
-    int compress;
-    SHA_CTX ctx;
-    unsigned char hash[SHA_DIGEST_LENGTH];
-    int cache_changed = 0;
-    int p_len_gz, p_len_br;
+    char *buf = malloc(CACHE_BUF_SIZE);
+    int err = 0;
+    do {
+        unsigned long len = (job->size - off < CACHE_BUF_SIZE) ? job->size - off : CACHE_BUF_SIZE;
+        unsigned long avail_in = len, avail_out;
+        int finish = off + len == job->size;
+        if (cache_job_read(job, buf, off, len) != 0) {
+            err = 1;
+            break;
+        }
+        do {
+            avail_out = CACHE_BUF_SIZE;
+            compress_compress_mode(&comp_ctx, mode, buf + len - avail_in, &avail_in, comp_buf, &avail_out, finish);
+            fwrite(comp_buf, 1, CACHE_BUF_SIZE - avail_out, comp_file);
+        } while (avail_in != 0 || avail_out != CACHE_BUF_SIZE);
+        off += len;
+    } while (off < job->size && cache_continue);
+    free(comp_buf);
+    free(buf);
+
+    compress_free(&comp_ctx);
+    fclose(comp_file);
+    if (err) {
+        unlink(filename_tmp);
+        return -1;
+    } else if (off < job->size) {
+        // interrupted
+        unlink(filename_tmp);
+        return -2;
+    }
+    if (cache_job_commit(job, filename_tmp, filename_comp) != 0) {
+        return -1;
+    }
+    fprintf(stdout, "[cache] Finished compressing file %s (%s)\n", job->filename,
+            (mode & COMPRESS_ZSTD) ? "zstd" : (mode & COMPRESS_BR) ? "br" : "gzip");
+    return 0;
+}
+
+int cache_job_commit(cache_job *job, const char *filename_tmp, const char *filename_comp) {
+    // the file must not have changed while it was read, the result is stored under the hash of the version
+    // that was opened (and replaces the files of the first pass when refining)
+    struct stat statbuf;
+    if (stat(job->filename, &statbuf) != 0 || statbuf.st_ino != job->stat.st_ino ||
+            statbuf.st_size != job->stat.st_size ||
+            memcmp(&statbuf.st_mtim, &job->stat.st_mtim, sizeof(statbuf.st_mtim)) != 0) {
+        fprintf(stderr, ERR_STR "File %s changed while compressing" CLR_STR "\n", job->filename);
+        unlink(filename_tmp);
+        return -1;
+    }
+    if (rename(filename_tmp, filename_comp) != 0) {
+        fprintf(stderr, ERR_STR "Unable to rename cached file: %s" CLR_STR "\n", strerror(errno));
+        unlink(filename_tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int cache_job_compress_block(cache_job *job, int block) {
+    // pigz-style: raw deflate of one block, primed with the preceding input as dictionary and ended with a sync
+    // flush, so that the blocks concatenate to a single valid deflate stream
+    unsigned long off = (unsigned long) block * CACHE_PAR_BLOCK_SIZE;
+    unsigned long len = (job->size - off < CACHE_PAR_BLOCK_SIZE) ? job->size - off : CACHE_PAR_BLOCK_SIZE;
+    int last = off + len == job->size;
+    cache_gz_block *gz = &job->gz[block];
+    z_stream strm = {.zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL};
+
+    if (block == 0) {
+        fprintf(stdout, "[cache] Compressing file %s (gzip, %i blocks)\n", job->filename, job->gz_blocks);
+    }
+    // the block is read together with the preceding dictionary
+    unsigned long dict_len = (off < CACHE_PAR_DICT_SIZE) ? off : CACHE_PAR_DICT_SIZE;
+    unsigned char *buf = malloc(dict_len + len);
+    if (buf == NULL || cache_job_read(job, (char *) buf, off - dict_len, dict_len + len) != 0) {
+        free(buf);
+        return -1;
+    }
+    if (deflateInit2(&strm, job->fast ? CACHE_FAST_LEVEL_GZIP : COMPRESS_LEVEL_GZIP, Z_DEFLATED, -15, 9,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, ERR_STR "Unable to init compression" CLR_STR "\n");
+        free(buf);
+        return -1;
+    }
+    if (dict_len > 0) {
+        deflateSetDictionary(&strm, buf, dict_len);
+    }
+
+    // the bound does not include the empty stored block of the sync flush
+    unsigned long size = deflateBound(&strm, len) + 16;
+    gz->buf = malloc(size);
+    if (gz->buf == NULL) {
+        deflateEnd(&strm);
+        free(buf);
+        return -1;
+    }
+    strm.next_in = buf + dict_len;
+    strm.avail_in = len;
+    strm.next_out = (unsigned char *) gz->buf;
+    strm.avail_out = size;
+    int ret = deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+    gz->len = size - strm.avail_out;
+    gz->crc = crc32(0, buf + dict_len, len);
+    deflateEnd(&strm);
+    free(buf);
+
+    if ((last && ret != Z_STREAM_END) || (!last && (ret != Z_OK || strm.avail_in != 0 || strm.avail_out == 0))) {
+        fprintf(stderr, ERR_STR "Unable to compress block %i of file %s" CLR_STR "\n", block, job->filename);
+        return -1;
+    }
+    return 0;
+}
+
+int cache_job_compress_blocks_finish(cache_job *job) {
+    char filename_tmp[272];
+    unsigned char trailer[8];
+    // gzip header: no file name, no mtime, unix
+    const unsigned char header[10] = {0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, job->fast ? 0 : 2, 3};
+
+    sprintf(filename_tmp, "%s.%i.tmp", job->filename_comp_gz, job->entry_num);
+    FILE *comp_file = fopen(filename_tmp, "wb");
+    if (comp_file == NULL) {
+        fprintf(stderr, ERR_STR "Unable to open cached file: %s" CLR_STR "\n", strerror(errno));
+        return -1;
+    }
+
+    unsigned long crc = job->gz[0].crc;
+    fwrite(header, 1, sizeof(header), comp_file);
+    for (int i = 0; i < job->gz_blocks; i++) {
+        fwrite(job->gz[i].buf, 1, job->gz[i].len, comp_file);
+        if (i > 0) {
+            unsigned long len = (i == job->gz_blocks - 1) ? job->size - (unsigned long) i * CACHE_PAR_BLOCK_SIZE :
+                                CACHE_PAR_BLOCK_SIZE;
+            crc = crc32_combine(crc, job->gz[i].crc, (long) len);
+        }
+        free(job->gz[i].buf);
+        job->gz[i].buf = NULL;
+    }
+    for (int i = 0; i < 4; i++) {
+        trailer[i] = (unsigned char) (crc >> (i * 8));
+        trailer[i + 4] = (unsigned char) (job->size >> (i * 8));
+    }
+    fwrite(trailer, 1, sizeof(trailer), comp_file);
+    if (fclose(comp_file) != 0) {
+        fprintf(stderr, ERR_STR "Unable to write cached file: %s" CLR_STR "\n", strerror(errno));
+        unlink(filename_tmp);
+        return -1;
+    }
+
+    if (cache_job_commit(job, filename_tmp, job->filename_comp_gz) != 0) {
+        return -1;
+    }
+    fprintf(stdout, "[cache] Finished compressing file %s (gzip)\n", job->filename);
+    return 0;
+}
+
+void cache_job_push_compress(cache_job *job) {
+    // gzip of files too large for one shot is split into blocks compressed in parallel, zstd uses its own
+    // worker threads (see tools/compress-bench.c: below that size brotli always takes longer than gzip,
+    // so blocks would only cost CPU time); encodings provided by precompressed files of the build are skipped
+    int modes = COMPRESS & ~job->sidecar;
+    job->gz_blocks = 0;
+    if ((modes & COMPRESS_GZ) && cache_num_threads > 1 && job->size >= CACHE_ONESHOT_SIZE) {
+        job->gz_blocks = (int) ((job->size + CACHE_PAR_BLOCK_SIZE - 1) / CACHE_PAR_BLOCK_SIZE);
+        job->gz_blocks_pending = job->gz_blocks;
+        job->gz = calloc(job->gz_blocks, sizeof(cache_gz_block));
+    }
+    int tasks = ((modes & COMPRESS_GZ) ? (job->gz_blocks > 0 ? job->gz_blocks : 1) : 0) +
+                ((modes & COMPRESS_BR) ? 1 : 0) + ((modes & COMPRESS_ZSTD) ? 1 : 0);
+    __atomic_add_fetch(&job->pending, tasks, __ATOMIC_ACQ_REL);
+    if (job->gz_blocks > 0) {
+        for (int i = 0; i < job->gz_blocks; i++) {
+            cache_queue_push(job, CACHE_TASK_GZ_BLOCK, i);
+        }
+    } else if (modes & COMPRESS_GZ) {
+        cache_queue_push(job, COMPRESS_GZ, 0);
+    }
+    if (modes & COMPRESS_BR) {
+        cache_queue_push(job, COMPRESS_BR, 0);
+    }
+    if (modes & COMPRESS_ZSTD) {
+        cache_queue_push(job, COMPRESS_ZSTD, 0);
+    }
+}
+
+void cache_job_finish(cache_job *job) {
+    cache_entry *entry = &cache[job->entry_num];
+    close(job->fd);
+    free(job->digests);
+    if (job->gz != NULL) {
+        for (int i = 0; i < job->gz_blocks; i++) {
+            free(job->gz[i].buf);
+        }
+        free(job->gz);
+    }
+    if (job->refine) {
+        if (!job->err) {
+            // do not retry failed attempts
+            pthread_mutex_lock(&cache_blob_mutex);
+            cache_blobs[job->blob].optimized = 1;
+            pthread_mutex_unlock(&cache_blob_mutex);
+        }
+        cache_blob_release(job->blob);
+        goto end;
+    }
+
+    if (!job->err && job->compress) {
+        // the files match the hashed content, even if the entry does not anymore
+        pthread_mutex_lock(&cache_blob_mutex);
+        if (!cache_blobs[job->blob].ready) {
+            // compressed by this job
+            cache_blobs[job->blob].ready = 1;
+            cache_blobs[job->blob].optimized = !job->fast;
+        }
+        pthread_mutex_unlock(&cache_blob_mutex);
+        cache_neg_remove("", job->filename_comp_gz);
+        cache_neg_remove("", job->filename_comp_br);
+        cache_neg_remove("", job->filename_comp_zst);
+    }
+
+    cache_entry_lock(job->entry_num);
+    // workers may have updated the entry while the file was hashed
+    int stale = !cache_entry_match(job->entry_num, job->filename, &job->stat);
+    if (!job->err && !stale) {
+        if (job->compress) {
+            entry->blob = job->blob + 1;
+        } else {
+            cache_blob_release(job->blob);
+        }
+        snprintf(entry->etag, sizeof(entry->etag), "%.59s", job->etag);
+        entry->checksum = cache_entry_checksum(entry);
+    } else {
+        cache_blob_release(job->blob);
+    }
+    entry->is_updating = 0;
+    cache_entry_unlock(job->entry_num);
+    if (stale && cache_continue) {
+        // the update requested meanwhile was dropped, as the entry was still being updated
+        cache_request_update(job->entry_num);
+    }
+
+    end:
+    free(job);
+    unsigned long event = 1;
+    __atomic_sub_fetch(&cache_jobs, 1, __ATOMIC_ACQ_REL);
+    write(cache_event_fd, &event, sizeof(event));
+}
+
+void cache_queue_push(cache_job *job, int mode, int block) {
+    cache_task *task = malloc(sizeof(cache_task));
+    task->job = job;
+    task->mode = mode;
+    task->block = block;
+    task->next = NULL;
+    pthread_mutex_lock(&cache_queue_mutex);
+    if (cache_queue_tail == NULL) {
+        cache_queue_head = task;
+    } else {
+        cache_queue_tail->next = task;
+    }
+    cache_queue_tail = task;
+    pthread_cond_signal(&cache_queue_cond);
+    pthread_mutex_unlock(&cache_queue_mutex);
+}
+
+int cache_refine_next() {
+    int ret = 0;
+    pthread_mutex_lock(&cache_blob_mutex);
+    for (int b = 0; b < cache_index_size && ret == 0; b++) {
+        cache_blob *blob = &cache_blobs[b];
+        if (blob->hash[0] == 0 || !blob->ready || blob->optimized || blob->refs == 0) {
+            continue;
+        }
+        for (int i = 0; i < cache_entries; i++) {
+            if (cache[i].blob != b + 1 || cache[i].is_updating) {
+                continue;
+            }
+            cache_job *job = malloc(sizeof(cache_job));
+            job->entry_num = i;
+            job->err = 0;
+            job->fast = 0;
+            job->refine = 1;
+            job->digests = NULL;
+            job->gz = NULL;
+            job->blob = b;
+            if (cache_job_open(job) != 0) {
+                free(job);
+                continue;
+            }
+            strcpy(job->etag, blob->hash);
+            if (!job->compress ||
+                    cache_blob_filename(job->filename_comp_gz, sizeof(job->filename_comp_gz), job->etag, "gz") != 0 ||
+                    cache_blob_filename(job->filename_comp_br, sizeof(job->filename_comp_br), job->etag, "br") != 0 ||
+                    cache_blob_filename(job->filename_comp_zst, sizeof(job->filename_comp_zst), job->etag, "zst") != 0) {
+                close(job->fd);
+                free(job);
+                continue;
+            }
+            // keep the files referenced while they are replaced
+            __atomic_add_fetch(&blob->refs, 1, __ATOMIC_ACQ_REL);
+            __atomic_add_fetch(&cache_jobs, 1, __ATOMIC_ACQ_REL);
+            job->pending = 0;
+            cache_job_push_compress(job);
+            ret = 1;
+            break;
+        }
+        if (ret == 0) {
+            // no entry to read the content from
+            blob->optimized = 1;
+        }
+    }
+    pthread_mutex_unlock(&cache_blob_mutex);
+    return ret;
+}
+
+int cache_warm_dir(const char *webroot, char *path, unsigned long path_len, int *slot, int *num) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, ERR_STR "Unable to open directory %s: %s" CLR_STR "\n", path, strerror(errno));
+        return -1;
+    }
+
+    int ret = 0;
+    struct dirent *ent;
+    struct stat statbuf;
+    while (ret == 0 && cache_continue && (ent = readdir(dir)) != NULL) {
+        unsigned long len = path_len + 1 + strlen(ent->d_name);
+        if (ent->d_name[0] == '.' || len >= CACHE_PATH_SIZE) {
+            // skip hidden files, including .necronda-server
+            continue;
+        }
+        sprintf(path + path_len, "/%s", ent->d_name);
+        if (stat(path, &statbuf) != 0) {
+            // ignore
+        } else if (S_ISDIR(statbuf.st_mode)) {
+            ret = cache_warm_dir(webroot, path, len, slot, num);
+        } else if (S_ISREG(statbuf.st_mode) && !(len > 4 && strcmp(path + len - 4, ".php") == 0) &&
+                   cache_get_entry(path, cache_hash(path)) < 0) {
+            // only fill free entries, never evict files requested by clients
+            while (*slot < cache_entries && cache_entry_claim(*slot) != 0) (*slot)++;
+            if (*slot >= cache_entries) {
+                ret = 1;
+            } else if (cache_update_entry(*slot, path, webroot, 1) == 0) {
+                if (++(*num) % 100 == 0) {
+                    fprintf(stdout, "[cache] Warming up: %i files\n", *num);
+                }
+            }
+        }
+        path[path_len] = 0;
+    }
+    closedir(dir);
+    return ret;
+}
+
+void *cache_warm_thread(void *arg) {
+    char path[256];
+    int slot = 0, num = 0, ret = 0;
+    struct timespec begin, end;
+
+    // idle I/O class and lowest CPU priority, clients always come first
+    syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+    setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), 19);
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    fprintf(stdout, "[cache] Warming up file cache\n");
+    for (int i = 0; i < CONFIG_MAX_HOST_CONFIG && ret == 0 && cache_continue; i++) {
+        host_config *hc = &config[i];
+        if (hc->type != CONFIG_TYPE_LOCAL || strlen(hc->local.webroot) >= sizeof(path)) {
+            continue;
+        }
+        strcpy(path, hc->local.webroot);
+        ret = cache_warm_dir(hc->local.webroot, path, strlen(path), &slot, &num);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(stdout, "[cache] Finished warming up file cache: %i files in %.1f s%s\n", num,
+            (double) (end.tv_sec - begin.tv_sec) + (double) (end.tv_nsec - begin.tv_nsec) / 1e9,
+            ret == 1 ? " (cache full)" : "");
+
+    __atomic_store_n(&cache_warming, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+void *cache_process_thread(void *arg) {
     int ret;
-    while (cache_continue) {
-        for (int i = 0; i < CACHE_ENTRIES; i++) {
-            if (cache[i].filename[0] != 0 && cache[i].meta.etag[0] == 0 && !cache[i].is_updating) {
-                cache[i].is_updating = 1;
-                fprintf(stdout, "[cache] Hashing file %s\n", cache[i].filename);
-                SHA1_Init(&ctx);
-                file = fopen(cache[i].filename, "rb");
-                compress = mime_is_compressible(cache[i].meta.type);
-
-                compress_ctx comp_ctx;
-                FILE *comp_file_gz = NULL;
-                FILE *comp_file_br = NULL;
-                if (compress) {
-                    sprintf(buf, "%.*s/.necronda-server", cache[i].webroot_len, cache[i].filename);
-                    mkdir(buf, 0755);
-                    sprintf(buf, "%.*s/.necronda-server/cache", cache[i].webroot_len, cache[i].filename);
-                    mkdir(buf, 0700);
-                    char *rel_path = cache[i].filename + cache[i].webroot_len + 1;
-                    for (int j = 0; j < strlen(rel_path); j++) {
-                        char ch = rel_path[j];
-                        if (ch == '/') {
-                            ch = '_';
-                        }
-                        buf[j] = ch;
-                    }
-                    buf[strlen(rel_path)] = 0;
-
-                    p_len_gz = snprintf(filename_comp_gz, sizeof(filename_comp_gz),
-                                        "%.*s/.necronda-server/cache/%s.gz",
-                                        cache[i].webroot_len, cache[i].filename, buf);
-                    p_len_br = snprintf(filename_comp_br, sizeof(filename_comp_br),
-                                        "%.*s/.necronda-server/cache/%s.br",
-                                        cache[i].webroot_len, cache[i].filename, buf);
-                    if (p_len_gz < 0 || p_len_gz >= sizeof(filename_comp_gz) ||
-                            p_len_br < 0 || p_len_br >= sizeof(filename_comp_br)) {
-                        fprintf(stderr, ERR_STR "Unable to open cached file: "
-                                                "File name for compressed file too long" CLR_STR "\n");
-                        goto comp_err;
-                    }
-
-                    fprintf(stdout, "[cache] Compressing file %s\n", cache[i].filename);
-
-                    comp_file_gz = fopen(filename_comp_gz, "wb");
-                    comp_file_br = fopen(filename_comp_br, "wb");
-                    if (comp_file_gz == NULL || comp_file_br == NULL) {
-                        fprintf(stderr, ERR_STR "Unable to open cached file: %s" CLR_STR "\n", strerror(errno));
-                        comp_err:
-                        compress = 0;
-                    } else {
-                        ret = compress_init(&comp_ctx, COMPRESS_GZ | COMPRESS_BR);
-                        if (ret != 0) {
-                            fprintf(stderr, ERR_STR "Unable to init compression: %s" CLR_STR "\n", strerror(errno));
-                            compress = 0;
-                            fclose(comp_file_gz);
-                            fclose(comp_file_br);
-                        }
-                    }
+    while (1) {
+        pthread_mutex_lock(&cache_queue_mutex);
+        while (cache_queue_head == NULL && cache_continue) {
+            pthread_cond_wait(&cache_queue_cond, &cache_queue_mutex);
+        }
+        cache_task *task = cache_queue_head;
+        if (task == NULL) {
+            pthread_mutex_unlock(&cache_queue_mutex);
+            return NULL;
+        }
+        cache_queue_head = task->next;
+        if (cache_queue_head == NULL) {
+            cache_queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&cache_queue_mutex);
+
+        cache_job *job = task->job;
+        if (!cache_continue) {
+            job->err = 1;
+        } else if (task->mode == 0) {
+            if (job->err) {
+                // another block already failed
+            } else if (cache_job_hash(job, task->block) != 0) {
+                job->err = 1;
+            } else if (__atomic_sub_fetch(&job->blocks_pending, 1, __ATOMIC_ACQ_REL) == 0) {
+                if (cache_job_hash_final(job) != 0) {
+                    job->err = 1;
+                } else if (job->compress && cache_job_store(job) == 1) {
+                    // new content, compress it once for all entries sharing it
+                    // large files get a fast first pass, refined with maximum quality when idle
+                    job->fast = cache_fast_size != 0 && job->size >= cache_fast_size;
+                    cache_job_push_compress(job);
                 }
+            }
+        } else if (task->mode == CACHE_TASK_GZ_BLOCK) {
+            if (!job->compress) {
+                // another block already failed
+            } else if (cache_job_compress_block(job, task->block) != 0) {
+                job->compress = 0;
+            }
+            if (__atomic_sub_fetch(&job->gz_blocks_pending, 1, __ATOMIC_ACQ_REL) == 0 && job->compress &&
+                    cache_job_compress_blocks_finish(job) != 0) {
+                job->compress = 0;
+            }
+        } else if ((ret = cache_job_compress(job, task->mode)) == -2) {
+            job->err = 1;
+        } else if (ret != 0) {
+            job->compress = 0;
+        }
+        if (__atomic_sub_fetch(&job->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+            cache_job_finish(job);
+        }
+        free(task);
+    }
+}
+
+int cache_process() {
+    signal(SIGINT, cache_process_term);
+    signal(SIGTERM, cache_process_term);
+    signal(SIGHUP, cache_process_flush);
+    signal(SIGUSR1, cache_process_warm);
+    signal(SIGUSR2, cache_process_stats);
+
+    munmap(cache_map, cache_map_size);
+    cache = cache_rw;
+    cache_index = cache_index_rw;
+    cache_types = cache_types_rw;
+    cache_arena = cache_arena_rw;
 
-                while ((read = fread(buf, 1, CACHE_BUF_SIZE, file)) > 0) {
-                    SHA1_Update(&ctx, buf, read);
-                    if (compress) {
-                        unsigned long avail_in, avail_out;
-                        avail_in = read;
-                        do {
-                            avail_out = CACHE_BUF_SIZE;
-                            compress_compress_mode(&comp_ctx, COMPRESS_GZ,buf + read - avail_in, &avail_in,
-                                                   comp_buf, &avail_out, feof(file));
-                            fwrite(comp_buf, 1, CACHE_BUF_SIZE - avail_out, comp_file_gz);
-                        } while (avail_in != 0 || avail_out != CACHE_BUF_SIZE);
-                        avail_in = read;
-                        do {
-                            avail_out = CACHE_BUF_SIZE;
-                            compress_compress_mode(&comp_ctx, COMPRESS_BR, buf + read - avail_in, &avail_in,
-                                                   comp_buf, &avail_out, feof(file));
-                            fwrite(comp_buf, 1, CACHE_BUF_SIZE - avail_out, comp_file_br);
-                        } while (avail_in != 0 || avail_out != CACHE_BUF_SIZE);
-                    }
+    int num_threads = (int) cache_threads;
+    if (num_threads == 0) {
+        num_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+        if (num_threads <= 0) num_threads = 1;
+    }
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, cache_process_thread, NULL) != 0) {
+            fprintf(stderr, ERR_STR "Unable to create cache thread: %s" CLR_STR "\n", strerror(errno));
+            num_threads = i;
+            break;
+        }
+    }
+    if (num_threads == 0) {
+        free(threads);
+        return -1;
+    }
+    fprintf(stdout, "[cache] Started %i compression thread(s)\n", num_threads);
+    cache_num_threads = num_threads;
+
+    int *pending = malloc(cache_entries * sizeof(int));
+    unsigned char *is_pending = calloc(cache_entries, 1);
+    int pending_num = 0;
+    unsigned long event;
+    pthread_t warm_thread;
+    int warm_started = 0;
+    cache_st->queue_overflow = 1;
+    cache_warm_request = (int) cache_warm;
+    while (cache_continue) {
+        if (cache_warm_request && !__atomic_load_n(&cache_warming, __ATOMIC_ACQUIRE)) {
+            cache_warm_request = 0;
+            if (warm_started) pthread_join(warm_thread, NULL);
+            __atomic_store_n(&cache_warming, 1, __ATOMIC_RELEASE);
+            warm_started = pthread_create(&warm_thread, NULL, cache_warm_thread, NULL) == 0;
+            if (!warm_started) {
+                fprintf(stderr, ERR_STR "Unable to create cache warm-up thread: %s" CLR_STR "\n", strerror(errno));
+                cache_warming = 0;
+            }
+        }
+        if (cache_stats_request) {
+            cache_stats_request = 0;
+            fprintf(stdout, "[cache] Negative lookups: %lu hits, %lu stores\n",
+                    __atomic_load_n(&cache_st->neg_hits, __ATOMIC_RELAXED),
+                    __atomic_load_n(&cache_st->neg_stores, __ATOMIC_RELAXED));
+        }
+        if (__atomic_exchange_n(&cache_st->queue_overflow, 0, __ATOMIC_ACQ_REL)) {
+            for (int i = 0; i < cache_entries; i++) {
+                if (!is_pending[i] && cache[i].path_len != 0 && cache[i].etag[0] == 0) {
+                    is_pending[i] = 1;
+                    pending[pending_num++] = i;
                 }
+            }
+        }
+        if (__atomic_exchange_n(&cache_st->blob_gc, 0, __ATOMIC_ACQ_REL)) {
+            cache_blob_gc();
+        }
+        if (__atomic_exchange_n(&cache_st->index_compact, 0, __ATOMIC_ACQ_REL)) {
+            cache_index_compact();
+        }
+        if (__atomic_exchange_n(&cache_st->arena_compact, 0, __ATOMIC_ACQ_REL) && cache_arena_compact() != 0) {
+            // paths are still being allocated, retry with the next event
+            cache_st->arena_compact = 1;
+        }
+        while (1) {
+            unsigned int head = cache_st->queue_head;
+            int *slot = &cache_st->queue[head % CACHE_QUEUE_SIZE];
+            int entry_num = __atomic_load_n(slot, __ATOMIC_ACQUIRE) - 1;
+            if (entry_num < 0) break;
+            *slot = 0;
+            __atomic_store_n(&cache_st->queue_head, head + 1, __ATOMIC_RELEASE);
+            if (entry_num < cache_entries && !is_pending[entry_num]) {
+                is_pending[entry_num] = 1;
+                pending[pending_num++] = entry_num;
+            }
+        }
 
-                if (compress) {
-                    compress_free(&comp_ctx);
-                    fclose(comp_file_gz);
-                    fclose(comp_file_br);
-                    fprintf(stdout, "[cache] Finished compressing file %s\n", cache[i].filename);
-                    strcpy(cache[i].meta.filename_comp_gz, filename_comp_gz);
-                    strcpy(cache[i].meta.filename_comp_br, filename_comp_br);
+        while (pending_num > 0 && __atomic_load_n(&cache_jobs, __ATOMIC_ACQUIRE) < num_threads) {
+            // most requested entries first
+            int p = 0;
+            for (int j = 1; j < pending_num; j++) {
+                if (cache[pending[j]].hits > cache[pending[p]].hits) p = j;
+            }
+            int i = pending[p];
+            pending[p] = pending[--pending_num];
+            is_pending[i] = 0;
+            cache_entry_lock(i);
+            int skip = cache[i].path_len == 0 || cache[i].etag[0] != 0 || cache[i].is_updating;
+            if (!skip) cache[i].is_updating = 1;
+            cache_entry_unlock(i);
+            if (skip) {
+                continue;
+            }
+
+            cache_job *job = malloc(sizeof(cache_job));
+            job->entry_num = i;
+            job->err = 0;
+            job->blob = -1;
+            job->fast = 0;
+            job->refine = 0;
+            job->gz = NULL;
+            int ret = cache_job_open(job);
+            if (ret != 0) {
+                free(job);
+                cache_entry_lock(i);
+                if (ret < 0) {
+                    cache_index_remove(i);
+                    cache_entry_clear(i);
                 } else {
-                    memset(cache[i].meta.filename_comp_gz, 0, sizeof(cache[i].meta.filename_comp_gz));
-                    memset(cache[i].meta.filename_comp_br, 0, sizeof(cache[i].meta.filename_comp_br));
-                }
-                SHA1_Final(hash, &ctx);
-                memset(cache[i].meta.etag, 0, sizeof(cache[i].meta.etag));
-                for (int j = 0; j < SHA_DIGEST_LENGTH; j++) {
-                    sprintf(cache[i].meta.etag + j * 2, "%02x", hash[j]);
+                    cache[i].is_updating = 0;
                 }
-                fclose(file);
-                fprintf(stdout, "[cache] Finished hashing file %s\n", cache[i].filename);
-                cache[i].is_updating = 0;
-                cache_changed = 1;
+                cache_entry_unlock(i);
+                continue;
+            }
+            // blocks are hashed in parallel, gzip and brotli then run concurrently on the same file if needed
+            __atomic_add_fetch(&cache_jobs, 1, __ATOMIC_ACQ_REL);
+            job->blocks = job->size == 0 ? 1 : (int) ((job->size + CACHE_HASH_BLOCK_SIZE - 1) / CACHE_HASH_BLOCK_SIZE);
+            job->blocks_pending = job->blocks;
+            job->digests = malloc(job->blocks * EVP_MD_size(cache_md));
+            job->pending = job->blocks;
+            for (int j = 0; j < job->blocks; j++) {
+                cache_queue_push(job, 0, j);
             }
         }
 
-        if (cache_changed) {
-            cache_changed = 0;
-            cache_file = fopen("/var/necronda-server/cache", "wb");
-            if (cache_file == NULL) {
-                fprintf(stderr, ERR_STR "Unable to open cache file: %s" CLR_STR "\n", strerror(errno));
-                free(buf);
-                free(comp_buf);
-                return -1;
-            }
-            fwrite(cache, sizeof(cache_entry), CACHE_ENTRIES, cache_file);
-            fclose(cache_file);
-        } else {
-            sleep(1);
+        if (pending_num == 0 && __atomic_load_n(&cache_jobs, __ATOMIC_ACQUIRE) == 0) {
+            cache_refine_next();
+        }
+
+        // sleep until a worker requests an update, a job finishes or we get terminated
+        if (cache_continue && read(cache_event_fd, &event, sizeof(event)) < 0 && errno != EINTR) {
+            fprintf(stderr, ERR_STR "Unable to wait for cache events: %s" CLR_STR "\n", strerror(errno));
+            break;
         }
     }
-    free(buf);
-    free(comp_buf);
+    free(pending);
+    free(is_pending);
+    msync(cache_map_rw, cache_map_size, MS_SYNC);
+
+    pthread_mutex_lock(&cache_queue_mutex);
+    pthread_cond_broadcast(&cache_queue_cond);
+    pthread_mutex_unlock(&cache_queue_mutex);
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    if (warm_started) pthread_join(warm_thread, NULL);
     return 0;
 }
 
@@ -214,28 +1514,157 @@ int cache_init() {
         return -1;
     }
 
-    int shm_id = shmget(CACHE_SHM_KEY, CACHE_ENTRIES * sizeof(cache_entry), IPC_CREAT | IPC_EXCL | 0600);
-    if (shm_id < 0) {
-        fprintf(stderr, ERR_STR "Unable to create shared memory: %s" CLR_STR "\n", strerror(errno));
+    cache_md = EVP_get_digestbyname(CACHE_HASH_DIGEST);
+    if (cache_md == NULL) {
+        fprintf(stderr, ERR_STR "Unable to find hash algorithm " CACHE_HASH_DIGEST CLR_STR "\n");
+        return -1;
+    }
+
+    if (mkdir("/var/necronda-server/", 0755) < 0) {
+        if (errno != EEXIST) {
+            fprintf(stderr, ERR_STR "Unable to create directory '/var/necronda-server/': %s" CLR_STR "\n", strerror(errno));
+            return -2;
+        }
+    }
+    if (mkdir(cache_dir, 0700) < 0) {
+        if (errno != EEXIST) {
+            fprintf(stderr, ERR_STR "Unable to create directory '%s': %s" CLR_STR "\n", cache_dir, strerror(errno));
+            return -2;
+        }
+    }
+
+    // header | entries | index | blobs | types | state | negative lookups | path arena (page aligned, sparse)
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    cache_index_size = 1;
+    while (cache_index_size < 2 * cache_entries) cache_index_size <<= 1;
+    unsigned long arena_off = sizeof(cache_header) + cache_entries * sizeof(cache_entry) +
+                              cache_index_size * sizeof(int) + cache_index_size * sizeof(cache_blob) +
+                              CACHE_TYPES * sizeof(cache_type) + sizeof(cache_state) + CACHE_NEG_SIZE * sizeof(cache_neg);
+    arena_off = (arena_off + page - 1) / page * page;
+    cache_arena_size = cache_entries * CACHE_PATH_SIZE;
+    cache_map_size = arena_off + cache_arena_size;
+
+    int fd = open(CACHE_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, ERR_STR "Unable to open cache file: %s" CLR_STR "\n", strerror(errno));
+        return -2;
+    }
+
+    cache_header hdr;
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != CACHE_MAGIC ||
+            hdr.version != CACHE_VERSION || hdr.entry_size != sizeof(cache_entry)) {
+        // unknown or incompatible layout, start with an empty cache
+        memset(&hdr, 0, sizeof(hdr));
+        if (ftruncate(fd, 0) < 0) goto resize_err;
+    } else if (hdr.entries != cache_entries) {
+        // capacity changed, drop all compressed files and start with an empty cache
+        unsigned int old_blobs_size = 1;
+        while (old_blobs_size < 2 * hdr.entries) old_blobs_size <<= 1;
+        cache_blob *old_blobs = calloc(old_blobs_size, sizeof(cache_blob));
+        pread(fd, old_blobs, old_blobs_size * sizeof(cache_blob),
+              (long) (sizeof(hdr) + hdr.entries * sizeof(cache_entry) + old_blobs_size * sizeof(int)));
+        char buf[256];
+        for (int i = 0; i < old_blobs_size; i++) {
+            if (old_blobs[i].hash[0] == 0 || !old_blobs[i].ready) continue;
+            if (cache_blob_filename(buf, sizeof(buf), old_blobs[i].hash, "gz") == 0) unlink(buf);
+            if (cache_blob_filename(buf, sizeof(buf), old_blobs[i].hash, "br") == 0) unlink(buf);
+            if (cache_blob_filename(buf, sizeof(buf), old_blobs[i].hash, "zst") == 0) unlink(buf);
+        }
+        free(old_blobs);
+        memset(&hdr, 0, sizeof(hdr));
+        if (ftruncate(fd, 0) < 0) goto resize_err;
+    }
+    if (ftruncate(fd, (long) cache_map_size) < 0) {
+        resize_err:
+        fprintf(stderr, ERR_STR "Unable to resize cache file: %s" CLR_STR "\n", strerror(errno));
+        close(fd);
         return -2;
     }
 
-    void *shm = shmat(shm_id, NULL, SHM_RDONLY);
-    if (shm == (void *) -1) {
-        fprintf(stderr, ERR_STR "Unable to attach shared memory (ro): %s" CLR_STR "\n", strerror(errno));
+    cache_map = mmap(NULL, cache_map_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (cache_map == MAP_FAILED) {
+        fprintf(stderr, ERR_STR "Unable to map cache file (ro): %s" CLR_STR "\n", strerror(errno));
+        close(fd);
         return -3;
     }
-    cache = shm;
 
-    void *shm_rw = shmat(shm_id, NULL, 0);
-    if (shm_rw == (void *) -1) {
-        fprintf(stderr, ERR_STR "Unable to attach shared memory (rw): %s" CLR_STR "\n", strerror(errno));
+    cache_map_rw = mmap(NULL, cache_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (cache_map_rw == MAP_FAILED) {
+        fprintf(stderr, ERR_STR "Unable to map cache file (rw): %s" CLR_STR "\n", strerror(errno));
+        close(fd);
         return -4;
     }
-    cache = shm_rw;
-    memset(cache, 0, CACHE_ENTRIES * sizeof(cache_entry));
-    shmdt(shm_rw);
-    cache = shm;
+    close(fd);
+
+    cache = (cache_entry *) ((cache_header *) cache_map + 1);
+    cache_index = (int *) (cache + cache_entries);
+    cache_types = (cache_type *) ((cache_blob *) (cache_index + cache_index_size) + cache_index_size);
+    cache_arena = (char *) cache_map + arena_off;
+    cache_rw = (cache_entry *) ((cache_header *) cache_map_rw + 1);
+    cache_index_rw = (int *) (cache_rw + cache_entries);
+    cache_blobs = (cache_blob *) (cache_index_rw + cache_index_size);
+    cache_types_rw = (cache_type *) (cache_blobs + cache_index_size);
+    cache_st = (cache_state *) (cache_types_rw + CACHE_TYPES);
+    cache_negs = (cache_neg *) (cache_st + 1);
+    cache_arena_rw = (char *) cache_map_rw + arena_off;
+
+    cache_header *hdr_rw = cache_map_rw;
+    hdr_rw->magic = CACHE_MAGIC;
+    hdr_rw->version = CACHE_VERSION;
+    hdr_rw->entry_size = sizeof(cache_entry);
+    hdr_rw->entries = cache_entries;
+
+    memset(cache_st, 0, sizeof(cache_state));
+    memset(cache_negs, 0, CACHE_NEG_SIZE * sizeof(cache_neg));
+    strcpy(cache_types_rw[0].type, "application/octet-stream");
+    strcpy(cache_types_rw[0].charset, "binary");
+    for (int i = 0; i < cache_index_size; i++) {
+        // reference counts are rebuilt from the valid entries
+        cache_blobs[i].refs = 0;
+    }
+
+    int valid = 0;
+    for (int i = 0; i < cache_entries; i++) {
+        cache_entry *entry = &cache_rw[i];
+        entry->seq = 0;
+        if (entry->path_len == 0) {
+            // claim of a terminated worker
+            entry->is_updating = 0;
+            continue;
+        } else if (!cache_entry_valid(entry)) {
+            // torn or corrupted entry
+            memset(entry, 0, sizeof(cache_entry));
+            continue;
+        }
+        entry->is_updating = 0;
+        entry->referenced = 0;
+        entry->hits = 0;
+        if (entry->path + entry->path_len + 1 > cache_st->arena_tail) {
+            cache_st->arena_tail = entry->path + entry->path_len + 1;
+        }
+        valid++;
+
+        int b = entry->blob - 1;
+        if (b >= 0 && b < cache_index_size && cache_blobs[b].ready && strcmp(cache_blobs[b].hash, entry->etag) == 0) {
+            cache_blobs[b].refs++;
+        } else if (b >= 0) {
+            // compressed files are gone, hash and compress again
+            memset(entry->etag, 0, sizeof(entry->etag));
+            entry->blob = 0;
+            entry->checksum = cache_entry_checksum(entry);
+        }
+    }
+    cache_arena_compact();
+    cache_index_rebuild();
+    // remove compressed files no longer referenced by any entry
+    cache_st->blob_gc = 1;
+    fprintf(stderr, "Loaded %i entries from file cache\n", valid);
+
+    cache_event_fd = eventfd(0, EFD_CLOEXEC);
+    if (cache_event_fd < 0) {
+        fprintf(stderr, ERR_STR "Unable to create event fd: %s" CLR_STR "\n", strerror(errno));
+        return -2;
+    }
 
     pid_t pid = fork();
     if (pid == 0) {
@@ -256,132 +1685,204 @@ int cache_init() {
 }
 
 int cache_unload() {
-    int shm_id = shmget(CACHE_SHM_KEY, 0, 0);
-    if (shm_id < 0) {
-        fprintf(stderr, ERR_STR "Unable to get shared memory id: %s" CLR_STR "\n", strerror(errno));
-        shmdt(cache);
-        return -1;
-    } else if (shmctl(shm_id, IPC_RMID, NULL) < 0) {
-        fprintf(stderr, ERR_STR "Unable to configure shared memory: %s" CLR_STR "\n", strerror(errno));
-        shmdt(cache);
-        return -1;
-    }
-    shmdt(cache);
+    munmap(cache_map, cache_map_size);
+    munmap(cache_map_rw, cache_map_size);
     return 0;
 }
 
-int cache_update_entry(int entry_num, const char *filename, const char *webroot) {
-    void *cache_ro = cache;
-    int shm_id = shmget(CACHE_SHM_KEY, 0, 0);
-    void *shm_rw = shmat(shm_id, NULL, 0);
-    if (shm_rw == (void *) -1) {
-        print(ERR_STR "Unable to attach shared memory (rw): %s" CLR_STR, strerror(errno));
-        return -1;
-    }
-    cache = shm_rw;
+int cache_evict_entry() {
+    // CLOCK: skip and clear recently referenced entries, take the first unreferenced one
+    for (int n = 0; n < 2 * cache_entries; n++) {
+        int i = (int) (__atomic_fetch_add(&cache_st->clock_hand, 1, __ATOMIC_RELAXED) % cache_entries);
+        cache_entry *entry = &cache_rw[i];
+        if (entry->path_len == 0) {
+            if (cache_entry_claim(i) == 0) return i;
+            continue;
+        } else if (entry->is_updating) {
+            continue;
+        } else if (entry->referenced) {
+            entry->referenced = 0;
+            continue;
+        }
 
-    struct stat statbuf;
-    stat(filename, &statbuf);
-    memcpy(&cache[entry_num].meta.stat, &statbuf, sizeof(statbuf));
+        char path[CACHE_PATH_SIZE];
+        int len = cache_entry_path(i, path);
+        cache_entry_lock(i);
+        if (entry->path_len == 0 || entry->is_updating) {
+            // taken by the updater or evicted by another worker in the meantime
+            cache_entry_unlock(i);
+            continue;
+        }
+        cache_index_remove(i);
+        cache_blob_release(entry->blob - 1);
+        cache_entry_clear(i);
+        // claimed for the caller
+        entry->is_updating = 1;
+        cache_entry_unlock(i);
+        if (len > 0) {
+            print("Evicting %s from file cache", path);
+        }
+        return i;
+    }
+    return -1;
+}
 
-    cache[entry_num].webroot_len = (unsigned char) strlen(webroot);
-    strcpy(cache[entry_num].filename, filename);
+int cache_sidecars(const char *filename, const struct stat *statbuf) {
+    // precompressed files next to the original, only valid if not older than it
+    char buf[CACHE_PATH_SIZE + 4];
+    struct stat sc;
+    int ret = 0;
+    const char *exts[] = {"gz", "br", "zst"};
+    const int modes[] = {COMPRESS_GZ, COMPRESS_BR, COMPRESS_ZSTD};
+    for (int i = 0; i < 3; i++) {
+        snprintf(buf, sizeof(buf), "%s.%s", filename, exts[i]);
+        if (stat(buf, &sc) == 0 && S_ISREG(sc.st_mode) && (sc.st_mtim.tv_sec > statbuf->st_mtim.tv_sec ||
+                (sc.st_mtim.tv_sec == statbuf->st_mtim.tv_sec && sc.st_mtim.tv_nsec >= statbuf->st_mtim.tv_nsec))) {
+            ret |= modes[i];
+        }
+    }
+    return ret;
+}
 
-    magic_setflags(magic, MAGIC_MIME_TYPE);
-    const char *type = magic_file(magic, filename);
-    char type_new[24];
-    sprintf(type_new, "%s", type);
-    if (strncmp(type, "text/", 5) == 0) {
-        if (strcmp(filename + strlen(filename) - 4, ".css") == 0) {
-            sprintf(type_new, "text/css");
-        } else if (strcmp(filename + strlen(filename) - 3, ".js") == 0) {
-            sprintf(type_new, "application/javascript");
+int cache_update_entry(int entry_num, const char *filename, const char *webroot, int is_new) {
+    // new entries have to be claimed by the caller
+    cache_entry *entry = &cache_rw[entry_num];
+    struct stat statbuf;
+    char type[32], charset[16];
+    unsigned long len = strlen(filename);
+    int path = 0;
+    if (len >= CACHE_PATH_SIZE || stat(filename, &statbuf) != 0 ||
+            (is_new && (path = cache_arena_alloc(filename, len)) < 0)) {
+        if (is_new) {
+            cache_entry_lock(entry_num);
+            entry->is_updating = 0;
+            cache_entry_unlock(entry_num);
         }
+        return -1;
     }
-    strcpy(cache[entry_num].meta.type, type_new);
+    cache_file_type(filename, type, charset);
+    int type_id = cache_type_get(type, charset);
+    int sidecar = cache_sidecars(filename, &statbuf);
 
-    magic_setflags(magic, MAGIC_MIME_ENCODING);
-    strcpy(cache[entry_num].meta.charset, magic_file(magic, filename));
+    cache_entry_lock(entry_num);
+    if (!is_new && !cache_entry_match(entry_num, filename, NULL)) {
+        // evicted in the meantime
+        cache_entry_unlock(entry_num);
+        return -1;
+    }
+    if (is_new) {
+        entry->path = path;
+        entry->path_len = (unsigned short) len;
+        entry->hash = cache_hash(filename);
+        entry->is_updating = 0;
+        __atomic_sub_fetch(&cache_st->arena_pending, 1, __ATOMIC_ACQ_REL);
+    }
+    entry->webroot_len = (unsigned char) strlen(webroot);
+    entry->type = (unsigned char) type_id;
+    entry->sidecar = sidecar;
+    entry->ino = statbuf.st_ino;
+    entry->size = statbuf.st_size;
+    entry->mtime = statbuf.st_mtim;
 
-    memset(cache[entry_num].meta.etag, 0, sizeof(cache[entry_num].meta.etag));
-    memset(cache[entry_num].meta.filename_comp_gz, 0, sizeof(cache[entry_num].meta.filename_comp_gz));
-    memset(cache[entry_num].meta.filename_comp_br, 0, sizeof(cache[entry_num].meta.filename_comp_br));
-    cache[entry_num].is_updating = 0;
+    cache_blob_release(entry->blob - 1);
+    entry->blob = 0;
+    memset(entry->etag, 0, sizeof(entry->etag));
+    // a running job notices the change itself
+    entry->checksum = cache_entry_checksum(entry);
+    cache_entry_unlock(entry_num);
 
-    shmdt(shm_rw);
-    cache = cache_ro;
+    if (is_new) {
+        cache_index_insert(entry_num);
+    }
+    cache_request_update(entry_num);
     return 0;
 }
 
 int cache_filename_comp_invalid(const char *filename) {
-    void *cache_ro = cache;
-    int shm_id = shmget(CACHE_SHM_KEY, 0, 0);
-    void *shm_rw = shmat(shm_id, NULL, 0);
-    if (shm_rw == (void *) -1) {
-        print(ERR_STR "Unable to attach shared memory (rw): %s" CLR_STR, strerror(errno));
-        return -1;
-    }
-    cache = shm_rw;
-
-    int i;
-    for (i = 0; i < CACHE_ENTRIES; i++) {
-        if (cache[i].filename[0] != 0 && strlen(cache[i].filename) == strlen(filename) &&
-                strcmp(cache[i].filename, filename) == 0) {
-            if (cache[i].is_updating) {
-                return 0;
-            } else {
-                break;
-            }
-        }
+    int i = cache_get_entry(filename, cache_hash(filename));
+    if (i < 0) {
+        return 0;
     }
 
-    memset(cache[i].meta.etag, 0, sizeof(cache[i].meta.etag));
-    memset(cache[i].meta.filename_comp_gz, 0, sizeof(cache[i].meta.filename_comp_gz));
-    memset(cache[i].meta.filename_comp_br, 0, sizeof(cache[i].meta.filename_comp_br));
-    cache[i].is_updating = 0;
+    cache_entry *entry = &cache_rw[i];
+    cache_entry_lock(i);
+    if (entry->is_updating || !cache_entry_match(i, filename, NULL)) {
+        cache_entry_unlock(i);
+        return 0;
+    }
+    cache_blob_release(entry->blob - 1);
+    entry->blob = 0;
+    // compress it ourselves if precompressed files have vanished
+    entry->sidecar = 0;
+    memset(entry->etag, 0, sizeof(entry->etag));
+    entry->checksum = cache_entry_checksum(entry);
+    cache_entry_unlock(i);
 
-    shmdt(shm_rw);
-    cache = cache_ro;
+    cache_request_update(i);
     return 0;
 }
 
+int cache_weak_etag(const meta_data *meta, char *buf, unsigned long size) {
+    int len = snprintf(buf, size, "W/\"%lx-%lx-%lx.%lx\"", (unsigned long) meta->stat.st_ino,
+                       (unsigned long) meta->stat.st_size, (unsigned long) meta->stat.st_mtim.tv_sec,
+                       (unsigned long) meta->stat.st_mtim.tv_nsec);
+    return (len < 0 || len >= size) ? -1 : 0;
+}
+
 int uri_cache_init(http_uri *uri) {
     if (uri->filename == NULL) {
         return 0;
     }
-
-    int i;
-    for (i = 0; i < CACHE_ENTRIES; i++) {
-        if (cache[i].filename[0] != 0 && strlen(cache[i].filename) == strlen(uri->filename) &&
-                strcmp(cache[i].filename, uri->filename) == 0) {
-            uri->meta = &cache[i].meta;
-            if (cache[i].is_updating) {
-                return 0;
-            } else {
-                break;
-            }
+    if (uri->meta == NULL) {
+        // workers only use a private snapshot of the shared entry
+        uri->meta = malloc(sizeof(meta_data));
+        if (uri->meta == NULL) {
+            return -1;
         }
     }
 
-    if (uri->meta == NULL) {
-        for (i = 0; i < CACHE_ENTRIES; i++) {
-            if (cache[i].filename[0] == 0) {
-                if (cache_update_entry(i, uri->filename, uri->webroot) != 0) {
-                    return -1;
-                }
-                uri->meta = &cache[i].meta;
-                break;
-            }
+    int i = cache_get_entry(uri->filename, cache_hash(uri->filename));
+    if (i >= 0 && cache_entry_read(i, uri->filename, uri->meta) != 0) {
+        // evicted in the meantime
+        i = -1;
+    }
+
+    if (i < 0) {
+        i = cache_evict_entry();
+        if (i < 0 || cache_update_entry(i, uri->filename, uri->webroot, 1) != 0 ||
+                cache_entry_read(i, uri->filename, uri->meta) != 0) {
+            goto uncached;
         }
-    } else {
-        struct stat statbuf;
-        stat(uri->filename, &statbuf);
-        if (memcmp(&uri->meta->stat.st_mtime, &statbuf.st_mtime, sizeof(statbuf.st_mtime)) != 0) {
-            if (cache_update_entry(i, uri->filename, uri->webroot) != 0) {
-                return -1;
-            }
+        return 0;
+    }
+
+    if (!cache[i].referenced) {
+        cache_rw[i].referenced = 1;
+    }
+    if (uri->meta->etag[0] == 0) {
+        // demand for pending entries, used by the updater for prioritization
+        __atomic_add_fetch(&cache_rw[i].hits, 1, __ATOMIC_RELAXED);
+    }
+
+    struct stat statbuf;
+    stat(uri->filename, &statbuf);
+    if (uri->meta->stat.st_ino != statbuf.st_ino || uri->meta->stat.st_size != statbuf.st_size ||
+            memcmp(&uri->meta->stat.st_mtim, &statbuf.st_mtim, sizeof(statbuf.st_mtim)) != 0) {
+        // files are being deployed, previously missing paths may exist now
+        cache_neg_flush();
+        if (cache_update_entry(i, uri->filename, uri->webroot, 0) != 0 ||
+                cache_entry_read(i, uri->filename, uri->meta) != 0) {
+            goto uncached;
         }
     }
+    return 0;
 
+    uncached:
+    // no entry available, serve uncached
+    memset(uri->meta, 0, sizeof(meta_data));
+    if (stat(uri->filename, &uri->meta->stat) != 0) {
+        return -1;
+    }
+    cache_file_type(uri->filename, uri->meta->type, uri->meta->charset);
     return 0;
 }
@@ -9,45 +9,300 @@
 #define NECRONDA_SERVER_CACHE_H
 
 #include "uri.h"
+#include <time.h>
 
-#define CACHE_SHM_KEY 255641
+#define CACHE_MAGIC 0x4e434143
+#define CACHE_VERSION 7
 #define CACHE_ENTRIES 1024
+#define CACHE_TYPES 256
+#define CACHE_PATH_SIZE 256
+#define CACHE_QUEUE_SIZE 1024
 #define CACHE_BUF_SIZE 16384
+#define CACHE_HASH_BLOCK_SIZE (4 * 1024 * 1024)
+#define CACHE_FAST_SIZE (256 * 1024)
+#define CACHE_FAST_LEVEL_GZIP 6
+#define CACHE_FAST_LEVEL_BROTLI 5
+#define CACHE_FAST_LEVEL_ZSTD 3
+// gzip is split into blocks only from CACHE_ONESHOT_SIZE on, see tools/compress-bench.c; measured on a single
+// CPU, where blocks cannot run in parallel, but brotli (single-threaded) took longer than any gzip path
+#define CACHE_ONESHOT_SIZE (16 * 1024 * 1024)
+#define CACHE_PAR_SIZE (4 * 1024 * 1024)
+#define CACHE_PAR_BLOCK_SIZE (1024 * 1024)
+#define CACHE_PAR_DICT_SIZE 32768
+#define CACHE_TASK_GZ_BLOCK 8
+#define CACHE_NEG_SIZE 4096
+#define CACHE_NEG_TTL 10
+#define CACHE_LOCK_SPINS 1024
+#define CACHE_LOCK_TIMEOUT 1000
+
+#ifndef CACHE_HASH_DIGEST
+#   define CACHE_HASH_DIGEST "SHA256"
+#endif
 
 #ifndef CACHE_MAGIC_FILE
 #   define CACHE_MAGIC_FILE "/usr/share/file/misc/magic.mgc"
 #endif
 
+#ifndef CACHE_FILE
+#   define CACHE_FILE "/var/necronda-server/cache"
+#endif
+
+#ifndef CACHE_DIR
+#   define CACHE_DIR "/var/necronda-server/store"
+#endif
+
 #ifndef DEFAULT_CONFIG_FILE
 #   define DEFAULT_CONFIG_FILE "/etc/necronda-server/necronda-server.conf"
 #endif
 
 
 typedef struct {
-    char filename[256];
+    unsigned int magic;
+    unsigned int version;
+    unsigned int entry_size;
+    unsigned int entries;
+    char reserved[48];
+} cache_header;
+
+typedef struct {
+    char type[32];
+    char charset[16];
+} cache_type;
+
+typedef struct {
+    // first cache line: everything needed for lookup and revalidation
+    unsigned int seq;
+    unsigned int path;
+    unsigned long hash;
+    unsigned short path_len;
     unsigned char webroot_len;
+    unsigned char type;
     unsigned char is_updating:1;
-    meta_data meta;
+    unsigned char sidecar:3;
+    unsigned char referenced;
+    int blob;
+    unsigned int hits;
+    unsigned long ino;
+    long size;
+    struct timespec mtime;
+    // second cache line
+    unsigned int checksum;
+    char etag[60];
 } cache_entry;
 
-extern cache_entry *cache;
+typedef struct {
+    char hash[64];
+    unsigned int refs;
+    unsigned char ready:1;
+    unsigned char optimized:1;
+} cache_blob;
+
+typedef struct {
+    unsigned int clock_hand;
+    unsigned int queue_head, queue_tail;
+    int queue_overflow;
+    int blob_gc;
+    int arena_lock;
+    int arena_pending;
+    int arena_compact;
+    unsigned int arena_tail, arena_dead;
+    unsigned int neg_gen;
+    unsigned int index_seq;
+    unsigned int index_dead;
+    int index_compact;
+    unsigned long neg_hits, neg_stores;
+    int queue[CACHE_QUEUE_SIZE];
+} cache_state;
+
+typedef struct {
+    unsigned long hash;
+    unsigned int gen;
+    unsigned int expires;
+} cache_neg;
+
+typedef struct {
+    char *buf;
+    unsigned long len;
+    unsigned long crc;
+} cache_gz_block;
+
+typedef struct {
+    int entry_num;
+    int pending;
+    int compress;
+    int err;
+    int blob;
+    int fast;
+    int refine;
+    int sidecar;
+    int blocks;
+    int blocks_pending;
+    unsigned char *digests;
+    int gz_blocks;
+    int gz_blocks_pending;
+    cache_gz_block *gz;
+    int fd;
+    unsigned long size;
+    struct stat stat;
+    char filename[256];
+    char type[32];
+    char etag[64];
+    char filename_comp_gz[256];
+    char filename_comp_br[256];
+    char filename_comp_zst[256];
+} cache_job;
+
+typedef struct cache_task {
+    cache_job *job;
+    int mode;
+    int block;
+    struct cache_task *next;
+} cache_task;
+
+extern cache_entry *cache, *cache_rw;
+extern int *cache_index, *cache_index_rw;
+extern unsigned int cache_index_size;
+extern cache_type *cache_types, *cache_types_rw;
+extern char *cache_arena, *cache_arena_rw;
+extern unsigned long cache_arena_size;
+extern cache_blob *cache_blobs;
+extern cache_state *cache_st;
+extern cache_neg *cache_negs;
 
 extern int cache_continue;
 
 int magic_init();
 
+unsigned long cache_hash(const char *filename);
+
+unsigned int cache_entry_checksum(const cache_entry *entry);
+
+int cache_entry_valid(const cache_entry *entry);
+
+int cache_seq_wait(const unsigned int *seq, unsigned int *val);
+
+int cache_get_entry(const char *filename, unsigned long hash);
+
+void cache_entry_lock(int entry_num);
+
+void cache_entry_unlock(int entry_num);
+
+int cache_entry_lock_broken(int entry_num, unsigned int seq);
+
+void cache_entry_clear(int entry_num);
+
+int cache_entry_claim(int entry_num);
+
+int cache_entry_match(int entry_num, const char *filename, const struct stat *statbuf);
+
+int cache_entry_read(int entry_num, const char *filename, meta_data *meta);
+
+int cache_entry_path(int entry_num, char *buf);
+
+int cache_type_get(const char *type, const char *charset);
+
+void cache_file_type(const char *filename, char *type, char *charset);
+
+void cache_magic_type(const char *filename, char *type, char *charset);
+
+int cache_arena_alloc(const char *str, unsigned long len);
+
+int cache_arena_compact();
+
+void cache_index_lock();
+
+void cache_index_unlock();
+
+int cache_index_lock_broken(unsigned int seq);
+
+void cache_index_put(int entry_num);
+
+void cache_index_insert(int entry_num);
+
+void cache_index_remove(int entry_num);
+
+void cache_index_compact();
+
+void cache_index_rebuild();
+
+int cache_blob_filename(char *buf, unsigned long size, const char *hash, const char *ext);
+
+int cache_blob_acquire(const char *hash);
+
+void cache_blob_release(int entry_num);
+
+void cache_blob_gc();
+
+unsigned long cache_neg_key(const char *prefix, const char *path);
+
+int cache_neg_lookup(const char *prefix, const char *path);
+
+void cache_neg_store(const char *prefix, const char *path);
+
+void cache_neg_remove(const char *prefix, const char *path);
+
+void cache_neg_flush();
+
 void cache_process_term();
 
+void cache_request_update(int entry_num);
+
+int cache_job_open(cache_job *job);
+
+int cache_job_read(cache_job *job, char *buf, unsigned long off, unsigned long len);
+
+int cache_job_hash(cache_job *job, int block);
+
+int cache_job_hash_final(cache_job *job);
+
+int cache_job_store(cache_job *job);
+
+int cache_job_commit(cache_job *job, const char *filename_tmp, const char *filename_comp);
+
+int cache_job_compress_oneshot(cache_job *job);
+
+int cache_job_compress(cache_job *job, int mode);
+
+int cache_job_compress_block(cache_job *job, int block);
+
+int cache_job_compress_blocks_finish(cache_job *job);
+
+void cache_job_push_compress(cache_job *job);
+
+void cache_job_finish(cache_job *job);
+
+void cache_queue_push(cache_job *job, int mode, int block);
+
+int cache_refine_next();
+
+void cache_process_warm();
+
+void cache_process_flush();
+
+void cache_process_stats();
+
+int cache_warm_dir(const char *webroot, char *path, unsigned long path_len, int *slot, int *num);
+
+void *cache_warm_thread(void *arg);
+
+void *cache_process_thread(void *arg);
+
 int cache_process();
 
 int cache_init();
 
 int cache_unload();
 
-int cache_update_entry(int entry_num, const char *filename, const char *webroot);
+int cache_evict_entry();
+
+int cache_sidecars(const char *filename, const struct stat *statbuf);
+
+int cache_update_entry(int entry_num, const char *filename, const char *webroot, int is_new);
 
 int cache_filename_comp_invalid(const char *filename);
 
+int cache_weak_etag(const meta_data *meta, char *buf, unsigned long size);
+
 int uri_cache_init(http_uri *uri);
 
 #endif //NECRONDA_SERVER_CACHE_H
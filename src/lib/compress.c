@@ -8,11 +8,210 @@
 #include "compress.h"
 #include <malloc.h>
 #include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    int pressure;
+    int level_gzip;
+    int level_brotli;
+    int level_zstd;
+} compress_dyn_step;
+
+// pressure in percent of online CPUs, first matching step wins, -1 disables compression
+static const compress_dyn_step compress_dyn_steps[] = {
+        {50,  COMPRESS_DYN_LEVEL_GZIP, COMPRESS_DYN_LEVEL_BROTLI, COMPRESS_DYN_LEVEL_ZSTD},
+        {100, 4,                       2,                         2},
+        {200, 1,                       0,                         1},
+        {-1,  -1,                      -1,                        -1},
+};
+
+static int compress_load_pressure(void) {
+    static time_t last = 0;
+    static int pressure = 0;
+    static long cpus = 0;
+
+    time_t now = time(NULL);
+    if (now - last < COMPRESS_LOAD_INTERVAL) return pressure;
+    last = now;
+
+    if (cpus <= 0) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cpus <= 0) cpus = 1;
+    }
+
+    // /proc/loadavg: "0.42 0.35 0.30 3/512 12345" - 1 min average and currently runnable tasks
+    FILE *file = fopen("/proc/loadavg", "r");
+    if (file == NULL) return pressure;
+    double load = 0;
+    int running = 0, total = 0;
+    int ret = fscanf(file, "%lf %*f %*f %i/%i", &load, &running, &total);
+    fclose(file);
+    if (ret < 1) return pressure;
+
+    // the calling process is always runnable, do not count it
+    int load_pct = (int) (load * 100);
+    int run_pct = (running > 1) ? (running - 1) * 100 : 0;
+    // the runnable count reacts immediately but is noisy, only let it pull the average up halfway
+    pressure = (int) (((run_pct > load_pct) ? (load_pct + run_pct) / 2 : load_pct) / cpus);
+    return pressure;
+}
+
+typedef struct {
+    int mode;
+    int level;
+    z_stream *gzip;
+    ZSTD_CCtx *zstd;
+} compress_pool_entry;
+
+// per worker process, idle contexts only
+static compress_pool_entry compress_pool[COMPRESS_POOL_SIZE];
+static int compress_pool_next = 0;
+static void *compress_pool_blocks[COMPRESS_POOL_BLOCKS];
+
+static void *compress_brotli_alloc(void *opaque, size_t size) {
+    // brotli allocates the same set of block sizes for the same quality, reuse them
+    for (int i = 0; i < COMPRESS_POOL_BLOCKS; i++) {
+        void *block = compress_pool_blocks[i];
+        if (block != NULL && *((size_t *) block) == size) {
+            compress_pool_blocks[i] = NULL;
+            return (char *) block + COMPRESS_POOL_BLOCK_HDR;
+        }
+    }
+    void *block = malloc(size + COMPRESS_POOL_BLOCK_HDR);
+    if (block == NULL) return NULL;
+    *((size_t *) block) = size;
+    return (char *) block + COMPRESS_POOL_BLOCK_HDR;
+}
+
+static void compress_brotli_free(void *opaque, void *addr) {
+    if (addr == NULL) return;
+    void *block = (char *) addr - COMPRESS_POOL_BLOCK_HDR;
+    for (int i = 0; i < COMPRESS_POOL_BLOCKS; i++) {
+        if (compress_pool_blocks[i] == NULL) {
+            compress_pool_blocks[i] = block;
+            return;
+        }
+    }
+    free(block);
+}
+
+static int compress_pool_acquire(compress_ctx *ctx, int mode, int level) {
+    for (int i = 0; i < COMPRESS_POOL_SIZE; i++) {
+        compress_pool_entry *entry = &compress_pool[i];
+        if (entry->mode != mode || entry->level != level) continue;
+        ctx->gzip = entry->gzip;
+        ctx->zstd = entry->zstd;
+        entry->mode = 0;
+        entry->gzip = NULL;
+        entry->zstd = NULL;
+        if (ctx->gzip != NULL && deflateReset(ctx->gzip) != Z_OK) {
+            compress_free(ctx);
+            return -1;
+        }
+        if (ctx->zstd != NULL && ZSTD_isError(ZSTD_CCtx_reset(ctx->zstd, ZSTD_reset_session_only))) {
+            compress_free(ctx);
+            return -1;
+        }
+        return 0;
+    }
+    return -1;
+}
+
+static const compress_dyn_step *compress_dyn_step_get(void) {
+    int pressure = compress_load_pressure();
+    const compress_dyn_step *step = compress_dyn_steps;
+    while (step->pressure >= 0 && pressure >= step->pressure) step++;
+    return step;
+}
 
 int compress_init(compress_ctx *ctx, int mode) {
+    return compress_init_level(ctx, mode, COMPRESS_LEVEL_GZIP, COMPRESS_LEVEL_BROTLI, COMPRESS_LEVEL_ZSTD);
+}
+
+int compress_init_dynamic(compress_ctx *ctx, int mode) {
+    const compress_dyn_step *step = compress_dyn_step_get();
+    // caller decided to compress anyway, use the cheapest levels
+    if (step->pressure < 0) step--;
+    int level = (mode & COMPRESS_BR) ? step->level_brotli : (mode & COMPRESS_ZSTD) ? step->level_zstd : step->level_gzip;
+
     ctx->gzip = NULL;
     ctx->brotli = NULL;
+    ctx->zstd = NULL;
+    ctx->zstd_end = 0;
+    ctx->mode = mode;
+    ctx->level = level;
+    ctx->pooled = 1;
+    if (mode & (mode - 1)) {
+        errno = EINVAL;
+        return -1;
+    } else if ((mode & (COMPRESS_GZ | COMPRESS_ZSTD)) && compress_pool_acquire(ctx, mode, level) == 0) {
+        return 0;
+    } else if (mode & COMPRESS_BR) {
+        ctx->brotli = BrotliEncoderCreateInstance(compress_brotli_alloc, compress_brotli_free, NULL);
+        if (ctx->brotli == NULL) return -1;
+        BrotliEncoderSetParameter(ctx->brotli, BROTLI_PARAM_MODE, BROTLI_MODE_GENERIC);
+        BrotliEncoderSetParameter(ctx->brotli, BROTLI_PARAM_QUALITY, level);
+        return 0;
+    }
+    if (compress_init_level(ctx, mode, level, level, level) != 0) return -1;
+    ctx->level = level;
+    ctx->pooled = 1;
+    return 0;
+}
+
+int compress_dynamic_level(int mode) {
+    const compress_dyn_step *step = compress_dyn_step_get();
+    if (mode & COMPRESS_BR) {
+        return step->level_brotli;
+    } else if (mode & COMPRESS_ZSTD) {
+        return step->level_zstd;
+    } else if (mode & COMPRESS_GZ) {
+        return step->level_gzip;
+    }
+    return -1;
+}
+
+int compress_incompressible(const char *buf, unsigned long len) {
+    if (len > COMPRESS_SAMPLE_SIZE) len = COMPRESS_SAMPLE_SIZE;
+    if (len < COMPRESS_SAMPLE_SIZE / 4) return 0;
+
+    unsigned long count[256] = {0};
+    for (unsigned long i = 0; i < len; i++) count[(unsigned char) buf[i]]++;
+
+    // collision sum: uniformly distributed bytes (already compressed/encrypted) give about len^2 / 256,
+    // text and markup stay well above twice that value
+    unsigned long sum = 0;
+    for (int i = 0; i < 256; i++) sum += count[i] * count[i];
+    return sum * 256 < len * len * 3 / 2;
+}
+
+long compress_buffer(int mode, const char *in, unsigned long in_len, char *out, unsigned long out_size) {
+    // returns the compressed length, or -1 if it does not fit into out
+    compress_ctx ctx;
+    if (compress_init_dynamic(&ctx, mode) != 0) {
+        compress_free(&ctx);
+        return -1;
+    }
+    unsigned long avail_in = in_len, avail_out = out_size;
+    int ret = compress_compress(&ctx, in, &avail_in, out, &avail_out, 1);
+    int done = (mode & COMPRESS_GZ) ? ret == Z_STREAM_END :
+               (mode & COMPRESS_BR) ? ret == 0 && BrotliEncoderIsFinished(ctx.brotli) :
+               ret == 0 && ctx.zstd_end;
+    compress_release(&ctx);
+    if (!done || avail_in != 0) return -1;
+    return (long) (out_size - avail_out);
+}
+
+int compress_init_level(compress_ctx *ctx, int mode, int level_gzip, int level_brotli, int level_zstd) {
+    ctx->gzip = NULL;
+    ctx->brotli = NULL;
+    ctx->zstd = NULL;
+    ctx->zstd_end = 0;
     ctx->mode = 0;
+    ctx->level = -1;
+    ctx->pooled = 0;
     int ret;
     if (mode & COMPRESS_GZ) {
         ctx->mode |= COMPRESS_GZ;
@@ -20,7 +219,7 @@ int compress_init(compress_ctx *ctx, int mode) {
         ctx->gzip->zalloc = Z_NULL;
         ctx->gzip->zfree = Z_NULL;
         ctx->gzip->opaque = Z_NULL;
-        ret = deflateInit2(ctx->gzip, COMPRESS_LEVEL_GZIP, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY);
+        ret = deflateInit2(ctx->gzip, level_gzip, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY);
         if (ret != Z_OK) return -1;
     }
     if (mode & COMPRESS_BR) {
@@ -28,13 +227,20 @@ int compress_init(compress_ctx *ctx, int mode) {
         ctx->brotli = BrotliEncoderCreateInstance(NULL, NULL, NULL);
         if (ctx->brotli == NULL) return -1;
         BrotliEncoderSetParameter(ctx->brotli, BROTLI_PARAM_MODE, BROTLI_MODE_GENERIC);
-        BrotliEncoderSetParameter(ctx->brotli, BROTLI_PARAM_QUALITY, COMPRESS_LEVEL_BROTLI);
+        BrotliEncoderSetParameter(ctx->brotli, BROTLI_PARAM_QUALITY, level_brotli);
+    }
+    if (mode & COMPRESS_ZSTD) {
+        ctx->mode |= COMPRESS_ZSTD;
+        ctx->zstd = ZSTD_createCCtx();
+        if (ctx->zstd == NULL) return -1;
+        if (ZSTD_isError(ZSTD_CCtx_setParameter(ctx->zstd, ZSTD_c_compressionLevel, level_zstd))) return -1;
     }
     return 0;
 }
 
 int compress_compress(compress_ctx *ctx, const char *in, unsigned long *in_len, char *out, unsigned long *out_len, int finish) {
-    if ((ctx->mode & COMPRESS_GZ) && (ctx->mode & COMPRESS_BR)) {
+    if (ctx->mode & (ctx->mode - 1)) {
+        // more than one mode
         errno = EINVAL;
         return -1;
     }
@@ -42,7 +248,7 @@ int compress_compress(compress_ctx *ctx, const char *in, unsigned long *in_len,
 }
 
 int compress_compress_mode(compress_ctx *ctx, int mode, const char *in, unsigned long *in_len, char *out, unsigned long *out_len, int finish) {
-    if ((mode & COMPRESS_GZ) && (mode & COMPRESS_BR)) {
+    if (mode & (mode - 1)) {
         errno = EINVAL;
         return -1;
     } else if (mode & COMPRESS_GZ) {
@@ -50,14 +256,31 @@ int compress_compress_mode(compress_ctx *ctx, int mode, const char *in, unsigned
         ctx->gzip->avail_in = *in_len;
         ctx->gzip->next_out = (unsigned char*) out;
         ctx->gzip->avail_out = *out_len;
-        int ret = deflate(ctx->gzip, finish ? Z_FINISH : Z_NO_FLUSH);
+        int ret = deflate(ctx->gzip, (finish == COMPRESS_FLUSH) ? Z_SYNC_FLUSH : finish ? Z_FINISH : Z_NO_FLUSH);
         *in_len = ctx->gzip->avail_in;
         *out_len = ctx->gzip->avail_out;
         return ret;
     } else if (mode & COMPRESS_BR) {
-        int ret = BrotliEncoderCompressStream(ctx->brotli, finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS,
-                                              in_len, (const unsigned char**) &in, out_len, (unsigned char **) &out, NULL);
+        BrotliEncoderOperation op = (finish == COMPRESS_FLUSH) ? BROTLI_OPERATION_FLUSH :
+                                    finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS;
+        int ret = BrotliEncoderCompressStream(ctx->brotli, op, in_len, (const unsigned char**) &in, out_len,
+                                              (unsigned char **) &out, NULL);
         return (ret == BROTLI_TRUE) ? 0 : -1;
+    } else if (mode & COMPRESS_ZSTD) {
+        if (ctx->zstd_end && *in_len == 0) {
+            // frame already finished, zstd would start a new one
+            return 0;
+        }
+        ZSTD_inBuffer in_buf = {.src = in, .size = *in_len, .pos = 0};
+        ZSTD_outBuffer out_buf = {.dst = out, .size = *out_len, .pos = 0};
+        size_t ret = ZSTD_compressStream2(ctx->zstd, &out_buf, &in_buf, (finish == COMPRESS_FLUSH) ? ZSTD_e_flush :
+                                          finish ? ZSTD_e_end : ZSTD_e_continue);
+        *in_len = in_buf.size - in_buf.pos;
+        *out_len = out_buf.size - out_buf.pos;
+        if (finish == 1 && ret == 0 && *in_len == 0) {
+            ctx->zstd_end = 1;
+        }
+        return ZSTD_isError(ret) ? -1 : 0;
     } else {
         errno = EINVAL;
         return -2;
@@ -74,6 +297,41 @@ int compress_free(compress_ctx *ctx) {
         BrotliEncoderDestroyInstance(ctx->brotli);
         ctx->brotli = NULL;
     }
+    if (ctx->zstd != NULL) {
+        ZSTD_freeCCtx(ctx->zstd);
+        ctx->zstd = NULL;
+    }
+    ctx->mode = 0;
+    return 0;
+}
+
+int compress_release(compress_ctx *ctx) {
+    if (!ctx->pooled || ctx->brotli != NULL || (ctx->gzip == NULL && ctx->zstd == NULL)) {
+        // brotli has no reset, its blocks go back to the pool when the instance is destroyed
+        return compress_free(ctx);
+    }
+
+    compress_pool_entry *entry = NULL;
+    for (int i = 0; i < COMPRESS_POOL_SIZE; i++) {
+        if (compress_pool[i].mode == 0) {
+            entry = &compress_pool[i];
+            break;
+        }
+    }
+    if (entry == NULL) {
+        // evict round robin
+        entry = &compress_pool[compress_pool_next];
+        compress_pool_next = (compress_pool_next + 1) % COMPRESS_POOL_SIZE;
+        compress_ctx old = {.mode = entry->mode, .gzip = entry->gzip, .brotli = NULL, .zstd = entry->zstd};
+        compress_free(&old);
+    }
+
+    entry->mode = ctx->mode;
+    entry->level = ctx->level;
+    entry->gzip = ctx->gzip;
+    entry->zstd = ctx->zstd;
+    ctx->gzip = NULL;
+    ctx->zstd = NULL;
     ctx->mode = 0;
     return 0;
 }
@@ -10,22 +10,56 @@
 
 #include <zlib.h>
 #include <brotli/encode.h>
+#include <zstd.h>
 
 #define COMPRESS_LEVEL_GZIP 9
 #define COMPRESS_LEVEL_BROTLI BROTLI_MAX_QUALITY
+#define COMPRESS_LEVEL_ZSTD 19
+
+#define COMPRESS_DYN_LEVEL_GZIP 6
+#define COMPRESS_DYN_LEVEL_BROTLI 4
+#define COMPRESS_DYN_LEVEL_ZSTD 3
+
+#define COMPRESS_MIN_SIZE 512
+#define COMPRESS_SAMPLE_SIZE 4096
+#define COMPRESS_BUFFER_SIZE 16384
+#define COMPRESS_BUFFER_TIMEOUT 5
+#define COMPRESS_LOAD_INTERVAL 1
+
+#define COMPRESS_POOL_SIZE 4
+#define COMPRESS_POOL_BLOCKS 16
+#define COMPRESS_POOL_BLOCK_HDR 16
 
 #define COMPRESS_GZ 1
 #define COMPRESS_BR 2
-#define COMPRESS 3
+#define COMPRESS_ZSTD 4
+#define COMPRESS 7
+
+// finish argument: emit all pending output without ending the stream
+#define COMPRESS_FLUSH 2
 
 typedef struct {
     int mode;
     z_stream *gzip;
     BrotliEncoderState *brotli;
+    ZSTD_CCtx *zstd;
+    int zstd_end;
+    int level;
+    int pooled;
 } compress_ctx;
 
 int compress_init(compress_ctx *ctx, int mode);
 
+int compress_init_level(compress_ctx *ctx, int mode, int level_gzip, int level_brotli, int level_zstd);
+
+int compress_init_dynamic(compress_ctx *ctx, int mode);
+
+int compress_dynamic_level(int mode);
+
+int compress_incompressible(const char *buf, unsigned long len);
+
+long compress_buffer(int mode, const char *in, unsigned long in_len, char *out, unsigned long out_size);
+
 int compress_compress(compress_ctx *ctx, const char *in, unsigned long *in_len, char *out, unsigned long *out_len,
                       int finish);
 
@@ -34,4 +68,6 @@ int compress_compress_mode(compress_ctx *ctx, int mode, const char *in, unsigned
 
 int compress_free(compress_ctx *ctx);
 
+int compress_release(compress_ctx *ctx);
+
 #endif //NECRONDA_SERVER_COMPRESS_H
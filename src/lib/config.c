@@ -6,6 +6,8 @@
  */
 
 #include "config.h"
+#include "cache.h"
+#include "compress.h"
 #include "utils.h"
 #include <stdio.h>
 #include <sys/ipc.h>
@@ -15,7 +17,9 @@
 #include <stdlib.h>
 
 host_config *config;
-char cert_file[256], key_file[256], geoip_dir[256], dns_server[256];
+char cert_file[256], key_file[256], geoip_dir[256], dns_server[256], cache_dir[256] = CACHE_DIR;
+unsigned int cache_entries = CACHE_ENTRIES, cache_threads = 0, cache_warm = 0, cache_neg_ttl = CACHE_NEG_TTL;
+unsigned long cache_fast_size = CACHE_FAST_SIZE, compress_min_size = COMPRESS_MIN_SIZE;
 
 int config_init() {
     int shm_id = shmget(CONFIG_SHM_KEY, CONFIG_MAX_HOST_CONFIG * sizeof(host_config), IPC_CREAT | IPC_EXCL | 0640);
@@ -101,6 +105,33 @@ int config_load(const char *filename) {
             } else if (len > 11 && strncmp(ptr, "dns_server", 10) == 0 && (ptr[10] == ' ' || ptr[10] == '\t')) {
                 source = ptr + 10;
                 target = dns_server;
+            } else if (len > 10 && strncmp(ptr, "cache_dir", 9) == 0 && (ptr[9] == ' ' || ptr[9] == '\t')) {
+                source = ptr + 9;
+                target = cache_dir;
+            } else if (len > 14 && strncmp(ptr, "cache_entries", 13) == 0 && (ptr[13] == ' ' || ptr[13] == '\t')) {
+                source = ptr + 13;
+                target = NULL;
+                mode = 3;
+            } else if (len > 14 && strncmp(ptr, "cache_threads", 13) == 0 && (ptr[13] == ' ' || ptr[13] == '\t')) {
+                source = ptr + 13;
+                target = NULL;
+                mode = 4;
+            } else if (len > 16 && strncmp(ptr, "cache_fast_size", 15) == 0 && (ptr[15] == ' ' || ptr[15] == '\t')) {
+                source = ptr + 15;
+                target = NULL;
+                mode = 5;
+            } else if (len > 11 && strncmp(ptr, "cache_warm", 10) == 0 && (ptr[10] == ' ' || ptr[10] == '\t')) {
+                source = ptr + 10;
+                target = NULL;
+                mode = 6;
+            } else if (len > 14 && strncmp(ptr, "cache_neg_ttl", 13) == 0 && (ptr[13] == ' ' || ptr[13] == '\t')) {
+                source = ptr + 13;
+                target = NULL;
+                mode = 7;
+            } else if (len > 18 && strncmp(ptr, "compress_min_size", 17) == 0 && (ptr[17] == ' ' || ptr[17] == '\t')) {
+                source = ptr + 17;
+                target = NULL;
+                mode = 8;
             }
         } else {
             host_config *hc = &tmp_config[i - 1];
@@ -159,7 +190,7 @@ int config_load(const char *filename) {
         char *end_ptr = source + strlen(source) - 1;
         while (source[0] == ' ' || source[0] == '\t') source++;
         while (end_ptr[0] == ' ' || end_ptr[0] == '\t') end_ptr--;
-        if (end_ptr <= source) {
+        if (end_ptr < source) {
             err:
             free(conf);
             free(tmp_config);
@@ -181,6 +212,25 @@ int config_load(const char *filename) {
             }
         } else if (mode == 2) {
             tmp_config[i - 1].rev_proxy.port = (unsigned short) strtoul(source, NULL, 10);
+        } else if (mode == 3) {
+            cache_entries = (unsigned int) strtoul(source, NULL, 10);
+            if (cache_entries == 0) goto err;
+        } else if (mode == 4) {
+            cache_threads = (unsigned int) strtoul(source, NULL, 10);
+        } else if (mode == 5) {
+            cache_fast_size = strtoul(source, NULL, 10);
+        } else if (mode == 6) {
+            if (strcmp(source, "on") == 0) {
+                cache_warm = 1;
+            } else if (strcmp(source, "off") == 0) {
+                cache_warm = 0;
+            } else {
+                goto err;
+            }
+        } else if (mode == 7) {
+            cache_neg_ttl = (unsigned int) strtoul(source, NULL, 10);
+        } else if (mode == 8) {
+            compress_min_size = strtoul(source, NULL, 10);
         }
     }
     free(conf);
@@ -34,7 +34,9 @@ typedef struct {
 } host_config;
 
 extern host_config *config;
-extern char cert_file[256], key_file[256], geoip_dir[256], dns_server[256];
+extern char cert_file[256], key_file[256], geoip_dir[256], dns_server[256], cache_dir[256];
+extern unsigned int cache_entries, cache_threads, cache_warm, cache_neg_ttl;
+extern unsigned long cache_fast_size, compress_min_size;
 
 int config_init();
 
@@ -5,12 +5,16 @@
  * Lorenz Stechauner, 2020-12-26
  */
 
+#define _POSIX_C_SOURCE 199309L
+
 #include "fastcgi.h"
 #include "utils.h"
 #include "compress.h"
 #include "../necronda-server.h"
 #include <sys/un.h>
 #include <sys/socket.h>
+#include <poll.h>
+#include <time.h>
 #include <errno.h>
 #include <string.h>
 
@@ -382,26 +386,114 @@ int fastcgi_header(fastcgi_conn *conn, http_res *res, char *err_msg) {
     return 0;
 }
 
+static void fastcgi_end_request(fastcgi_conn *conn, const char *content) {
+    FCGI_EndRequestBody *body = (FCGI_EndRequestBody *) content;
+    int app_status = (body->appStatusB3 << 24) | (body->appStatusB2 << 16) | (body->appStatusB1 << 8) |
+                     body->appStatusB0;
+    if (body->protocolStatus != FCGI_REQUEST_COMPLETE) {
+        print(ERR_STR "FastCGI protocol error: %i" CLR_STR, body->protocolStatus);
+    }
+    if (app_status != 0) {
+        print(ERR_STR "Script terminated with exit code %i" CLR_STR, app_status);
+    }
+    close(conn->socket);
+    conn->socket = 0;
+}
+
+int fastcgi_buffer(fastcgi_conn *conn, unsigned long size) {
+    // appends STDOUT records to out_buf until at least size body bytes are buffered, the request has ended
+    // or no record arrived in time
+    FCGI_Header header;
+    char buf0[256];
+    char *content;
+    unsigned short content_len, req_id;
+    long ret;
+    struct timespec begin, now;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    while (conn->socket != 0 && conn->out_len - conn->out_off < size) {
+        // PHP only gets COMPRESS_BUFFER_TIMEOUT ms in total, output of a script that pauses (flush()) is streamed
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long timeout = COMPRESS_BUFFER_TIMEOUT - ((now.tv_sec - begin.tv_sec) * 1000 +
+                                                  (now.tv_nsec - begin.tv_nsec) / 1000000);
+        struct pollfd fds = {.fd = conn->socket, .events = POLLIN};
+        if (poll(&fds, 1, timeout > 0 ? (int) timeout : 0) <= 0) {
+            break;
+        }
+
+        ret = recv(conn->socket, &header, sizeof(header), 0);
+        if (ret < 0) {
+            print(ERR_STR "Unable to receive from PHP-FPM: %s" CLR_STR, strerror(errno));
+            return -1;
+        } else if (ret != sizeof(header)) {
+            print(ERR_STR "Unable to receive from PHP-FPM" CLR_STR);
+            return -1;
+        }
+
+        req_id = (header.requestIdB1 << 8) | header.requestIdB0;
+        content_len = (header.contentLengthB1 << 8) | header.contentLengthB0;
+        content = malloc(content_len + header.paddingLength);
+        ret = recv(conn->socket, content, content_len + header.paddingLength, MSG_WAITALL);
+        if (ret < 0) {
+            print(ERR_STR "Unable to receive from PHP-FPM: %s" CLR_STR, strerror(errno));
+            free(content);
+            return -1;
+        } else if (ret != (content_len + header.paddingLength)) {
+            print(ERR_STR "Unable to receive from PHP-FPM" CLR_STR);
+            free(content);
+            return -1;
+        }
+
+        if (req_id != conn->req_id) {
+            // record of another request
+        } else if (header.type == FCGI_END_REQUEST) {
+            fastcgi_end_request(conn, content);
+        } else if (header.type == FCGI_STDERR) {
+            fastcgi_php_error(content, content_len, buf0);
+        } else if (header.type == FCGI_STDOUT) {
+            char *out_buf = realloc(conn->out_buf, conn->out_len + content_len);
+            if (out_buf == NULL) {
+                free(content);
+                return -1;
+            }
+            memcpy(out_buf + conn->out_len, content, content_len);
+            conn->out_buf = out_buf;
+            conn->out_len += content_len;
+        } else {
+            print(ERR_STR "Unknown FastCGI type: %i" CLR_STR, header.type);
+        }
+        free(content);
+    }
+    return 0;
+}
+
 int fastcgi_send(fastcgi_conn *conn, sock *client, int flags) {
     FCGI_Header header;
     long ret;
     char buf0[256];
     int len;
-    char *content, *ptr;
-    unsigned short req_id, content_len;
+    char *content, *ptr = NULL;
+    unsigned short req_id;
+    unsigned long content_len;
     char comp_out[4096];
     int finish_comp = 0;
 
     compress_ctx comp_ctx;
     if (flags & FASTCGI_COMPRESS_BR) {
-        flags &= ~FASTCGI_COMPRESS_GZ;
-        if (compress_init(&comp_ctx, COMPRESS_BR) != 0) {
+        flags &= ~(FASTCGI_COMPRESS_GZ | FASTCGI_COMPRESS_ZSTD);
+        if (compress_init_dynamic(&comp_ctx, COMPRESS_BR) != 0) {
             print(ERR_STR "Unable to init brotli: %s" CLR_STR, strerror(errno));
             flags &= ~FASTCGI_COMPRESS_BR;
         }
+    } else if (flags & FASTCGI_COMPRESS_ZSTD) {
+        flags &= ~(FASTCGI_COMPRESS_GZ | FASTCGI_COMPRESS_BR);
+        if (compress_init_dynamic(&comp_ctx, COMPRESS_ZSTD) != 0) {
+            print(ERR_STR "Unable to init zstd: %s" CLR_STR, strerror(errno));
+            flags &= ~FASTCGI_COMPRESS_ZSTD;
+        }
     } else if (flags & FASTCGI_COMPRESS_GZ) {
-        flags &= ~FASTCGI_COMPRESS_BR;
-        if (compress_init(&comp_ctx, COMPRESS_GZ) != 0) {
+        flags &= ~(FASTCGI_COMPRESS_BR | FASTCGI_COMPRESS_ZSTD);
+        if (compress_init_dynamic(&comp_ctx, COMPRESS_GZ) != 0) {
             print(ERR_STR "Unable to init gzip: %s" CLR_STR, strerror(errno));
             flags &= ~FASTCGI_COMPRESS_GZ;
         }
@@ -411,10 +503,17 @@ int fastcgi_send(fastcgi_conn *conn, sock *client, int flags) {
         content = conn->out_buf;
         ptr = content + conn->out_off;
         content_len = conn->out_len - conn->out_off;
+        conn->out_buf = NULL;
         goto out;
     }
+    free(conn->out_buf);
+    conn->out_buf = NULL;
 
     while (1) {
+        if (conn->socket == 0) {
+            // request already ended while buffering
+            goto end;
+        }
         ret = recv(conn->socket, &header, sizeof(header), 0);
         if (ret < 0) {
             print(ERR_STR "Unable to receive from PHP-FPM: %s" CLR_STR, strerror(errno));
@@ -439,26 +538,19 @@ int fastcgi_send(fastcgi_conn *conn, sock *client, int flags) {
             return -1;
         }
 
-        if (header.type == FCGI_END_REQUEST) {
-            FCGI_EndRequestBody *body = (FCGI_EndRequestBody *) content;
-            int app_status = (body->appStatusB3 << 24) | (body->appStatusB2 << 16) | (body->appStatusB1 << 8) |
-                             body->appStatusB0;
-            if (body->protocolStatus != FCGI_REQUEST_COMPLETE) {
-                print(ERR_STR "FastCGI protocol error: %i" CLR_STR, body->protocolStatus);
-            }
-            if (app_status != 0) {
-                print(ERR_STR "Script terminated with exit code %i" CLR_STR, app_status);
-            }
-            close(conn->socket);
-            conn->socket = 0;
+        if (req_id != conn->req_id) {
+            // record of another request
+        } else if (header.type == FCGI_END_REQUEST) {
+            fastcgi_end_request(conn, content);
             free(content);
 
+            end:
             if (flags & FASTCGI_COMPRESS) {
                 finish_comp = 1;
                 content_len = 0;
                 goto out;
                 finish:
-                compress_free(&comp_ctx);
+                compress_release(&comp_ctx);
             }
 
             if (flags & FASTCGI_CHUNKED) {
@@ -15,7 +15,8 @@
 #define FASTCGI_CHUNKED 1
 #define FASTCGI_COMPRESS_GZ 2
 #define FASTCGI_COMPRESS_BR 4
-#define FASTCGI_COMPRESS 6
+#define FASTCGI_COMPRESS_ZSTD 8
+#define FASTCGI_COMPRESS 14
 
 #ifndef PHP_FPM_SOCKET
 #   define PHP_FPM_SOCKET "/var/run/php-fpm/php-fpm.sock"
@@ -25,8 +26,8 @@ typedef struct {
     int socket;
     unsigned short req_id;
     char *out_buf;
-    unsigned short out_len;
-    unsigned short out_off;
+    unsigned long out_len;
+    unsigned long out_off;
 } fastcgi_conn;
 
 char *fastcgi_add_param(char *buf, const char *key, const char *value);
@@ -40,6 +41,8 @@ int fastcgi_php_error(const char *msg, int msg_len, char *err_msg);
 
 int fastcgi_header(fastcgi_conn *conn, http_res *res, char *err_msg);
 
+int fastcgi_buffer(fastcgi_conn *conn, unsigned long size);
+
 int fastcgi_send(fastcgi_conn *conn, sock *client, int flags);
 
 int fastcgi_receive(fastcgi_conn *conn, sock *client, unsigned long len);
@@ -5,10 +5,13 @@
  * Lorenz Stechauner, 2020-12-09
  */
 
+#define _GNU_SOURCE
+
 #include "http.h"
 #include "utils.h"
 #include "compress.h"
 #include <string.h>
+#include <stdlib.h>
 
 void http_to_camel_case(char *str, int mode) {
     char last = '-';
@@ -265,6 +268,26 @@ const http_status_msg *http_get_error_msg(const http_status *status) {
     return NULL;
 }
 
+static int http_mime_type_cmp(const void *key, const void *elem) {
+    return strcmp(key, ((const http_mime_type *) elem)->ext);
+}
+
+const http_mime_type *http_get_mime_type(const char *filename) {
+    const char *ext = strrchr(filename, '.');
+    if (ext == NULL || strchr(ext, '/') != NULL || strlen(ext + 1) >= 16) {
+        return NULL;
+    }
+    char ext_lower[16];
+    int i;
+    for (i = 0; ext[i + 1] != 0; i++) {
+        char ch = ext[i + 1];
+        ext_lower[i] = (char) ((ch >= 'A' && ch <= 'Z') ? ch | 0x20 : ch);
+    }
+    ext_lower[i] = 0;
+    return bsearch(ext_lower, http_mime_types, http_mime_types_size / sizeof(http_mime_type),
+                   sizeof(http_mime_type), http_mime_type_cmp);
+}
+
 const char *http_get_status_color(const http_status *status) {
     unsigned short code = status->code;
     if (code >= 100 && code < 200) {
@@ -293,6 +316,74 @@ char *http_get_date(char *buf, size_t size) {
     return http_format_date(rawtime, buf, size);
 }
 
+time_t http_parse_date(const char *date) {
+    struct tm timeinfo;
+    memset(&timeinfo, 0, sizeof(timeinfo));
+    const char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &timeinfo);
+    if (end == NULL || end[0] != 0) {
+        return -1;
+    }
+    return timegm(&timeinfo);
+}
+
+int http_etag_match(const char *list, const char *etag) {
+    // weak comparison (RFC 7232, section 2.3.2) of a list of entity-tags against etag
+    if (etag == NULL || etag[0] == 0) {
+        return 0;
+    }
+    if (etag[0] == 'W' && etag[1] == '/') etag += 2;
+    if (etag[0] == '"') etag++;
+    unsigned long len = strlen(etag);
+    if (len > 0 && etag[len - 1] == '"') len--;
+
+    const char *ptr = list;
+    while (1) {
+        while (*ptr == ' ' || *ptr == '\t' || *ptr == ',') ptr++;
+        if (*ptr == 0) {
+            return 0;
+        } else if (*ptr == '*') {
+            return 1;
+        }
+        if (ptr[0] == 'W' && ptr[1] == '/') ptr += 2;
+        const char *tag_end;
+        if (*ptr == '"') {
+            ptr++;
+            tag_end = strchr(ptr, '"');
+            if (tag_end == NULL) return 0;
+        } else {
+            // tolerate unquoted tags sent by older clients
+            tag_end = ptr + strcspn(ptr, ", \t");
+        }
+        if (tag_end - ptr == len && strncmp(ptr, etag, len) == 0) {
+            return 1;
+        }
+        ptr = (*tag_end == '"') ? tag_end + 1 : tag_end;
+    }
+}
+
+void http_merge_vary(http_hdr *hdr, const char *field_name) {
+    char buf[256];
+    const char *vary = http_get_header_field(hdr, "Vary");
+    if (vary == NULL) {
+        http_add_header_field(hdr, "Vary", field_name);
+        return;
+    }
+    unsigned long len = strlen(field_name);
+    const char *ptr = vary;
+    while (1) {
+        while (*ptr == ' ' || *ptr == '\t' || *ptr == ',') ptr++;
+        if (*ptr == 0) break;
+        unsigned long token_len = strcspn(ptr, ", \t");
+        if ((token_len == 1 && *ptr == '*') || (token_len == len && strncasecmp(ptr, field_name, len) == 0)) {
+            return;
+        }
+        ptr += token_len;
+    }
+    snprintf(buf, sizeof(buf), "%s, %s", vary, field_name);
+    http_remove_header_field(hdr, "Vary", HTTP_REMOVE_ALL);
+    http_add_header_field(hdr, "Vary", buf);
+}
+
 const http_doc_info *http_get_status_info(const http_status *status) {
     unsigned short code = status->code;
     static http_doc_info info[] = {
@@ -313,16 +404,116 @@ const http_doc_info *http_get_status_info(const http_status *status) {
     return NULL;
 }
 
+int http_select_encoding(const char *accept_encoding, int available, int dynamic) {
+    // Accept-Encoding with q-values (RFC 7231, section 5.3.4), ties are broken by our preference
+    static const int pref_static[] = {COMPRESS_BR, COMPRESS_ZSTD, COMPRESS_GZ};
+    static const int pref_dynamic[] = {COMPRESS_ZSTD, COMPRESS_BR, COMPRESS_GZ};
+    const int *pref = dynamic ? pref_dynamic : pref_static;
+    int q[3] = {-1, -1, -1}, q_any = -1;
+
+    const char *ptr = accept_encoding;
+    while (ptr != NULL && *ptr != 0) {
+        while (*ptr == ' ' || *ptr == '\t' || *ptr == ',') ptr++;
+        if (*ptr == 0) break;
+        unsigned long len = strcspn(ptr, ",; \t");
+        int quality = 1000;
+        const char *param = ptr + len;
+        while (*param == ' ' || *param == '\t') param++;
+        if (*param == ';') {
+            param++;
+            while (*param == ' ' || *param == '\t') param++;
+            if ((param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                quality = (int) (strtod(param + 2, NULL) * 1000);
+            }
+        }
+
+        int mode = 0;
+        if ((len == 4 && strncasecmp(ptr, "gzip", 4) == 0) || (len == 6 && strncasecmp(ptr, "x-gzip", 6) == 0)) {
+            mode = COMPRESS_GZ;
+        } else if (len == 2 && strncasecmp(ptr, "br", 2) == 0) {
+            mode = COMPRESS_BR;
+        } else if (len == 4 && strncasecmp(ptr, "zstd", 4) == 0) {
+            mode = COMPRESS_ZSTD;
+        } else if (len == 1 && ptr[0] == '*') {
+            q_any = quality;
+        }
+        for (int i = 0; i < 3; i++) {
+            if (mode == pref[i] && quality > q[i]) q[i] = quality;
+        }
+
+        ptr = strchr(ptr, ',');
+    }
+
+    int best = 0, best_q = 0;
+    for (int i = 0; i < 3; i++) {
+        int quality = (q[i] >= 0) ? q[i] : q_any;
+        if ((available & pref[i]) && quality > best_q) {
+            best = pref[i];
+            best_q = quality;
+        }
+    }
+    return best;
+}
+
 int http_get_compression(const http_req *req, const http_res *res) {
     char *accept_encoding = http_get_header_field(&req->hdr, "Accept-Encoding");
     char *content_type = http_get_header_field(&res->hdr, "Content-Type");
     char *content_encoding = http_get_header_field(&res->hdr, "Content-Encoding");
-    if (mime_is_compressible(content_type) && content_encoding == NULL && accept_encoding != NULL) {
-        if (strstr(accept_encoding, "br") != NULL) {
-            return COMPRESS_BR;
-        } else if (strstr(accept_encoding, "gzip") != NULL) {
-            return COMPRESS_GZ;
-        }
+    if (mime_is_compressible(content_type) && !mime_is_stream(content_type) && content_encoding == NULL &&
+            accept_encoding != NULL) {
+        return http_select_encoding(accept_encoding, COMPRESS, 1);
     }
     return 0;
 }
+
+int http_parse_ranges(const char *range, unsigned long size, http_range *ranges, int max_ranges) {
+    // returns the number of satisfiable ranges, -1 if invalid and -2 if the range set should be ignored
+    if (strncmp(range, "bytes=", 6) != 0) {
+        return -1;
+    }
+    int num = 0;
+    unsigned long total = 0;
+    const char *ptr = range + 6;
+    char *end;
+    while (1) {
+        unsigned long start, last;
+        while (*ptr == ' ' || *ptr == '\t') ptr++;
+        if (ptr[0] == '-' && ptr[1] >= '0' && ptr[1] <= '9') {
+            // suffix range: last n bytes
+            unsigned long n = strtoul(ptr + 1, &end, 10);
+            start = (n >= size) ? 0 : size - n;
+            last = size - 1;
+            if (n == 0) start = size;
+        } else if (ptr[0] >= '0' && ptr[0] <= '9') {
+            start = strtoul(ptr, &end, 10);
+            if (end[0] != '-') return -1;
+            end++;
+            if (end[0] >= '0' && end[0] <= '9') {
+                last = strtoul(end, &end, 10);
+                if (last < start) return -1;
+                if (last >= size) last = size - 1;
+            } else {
+                last = size - 1;
+            }
+        } else {
+            return -1;
+        }
+        while (*end == ' ' || *end == '\t') end++;
+
+        if (start < size) {
+            if (num >= max_ranges) return -2;
+            ranges[num].start = start;
+            ranges[num].end = last;
+            total += last - start + 1;
+            num++;
+        }
+        if (end[0] == 0) {
+            break;
+        } else if (end[0] != ',') {
+            return -1;
+        }
+        ptr = end + 1;
+    }
+    // overlapping ranges requesting more than the whole file
+    return (total > size) ? -2 : num;
+}
@@ -18,6 +18,8 @@
 #define HTTP_REMOVE_ALL 1
 #define HTTP_REMOVE_LAST 2
 
+#define HTTP_MAX_RANGES 16
+
 #define HTTP_1XX_STR "\x1B[1;32m"
 #define HTTP_2XX_STR "\x1B[1;32m"
 #define HTTP_3XX_STR "\x1B[1;33m"
@@ -50,6 +52,16 @@ typedef struct {
     const char *msg;
 } http_status_msg;
 
+typedef struct {
+    unsigned long start, end;
+} http_range;
+
+typedef struct {
+    const char *ext;
+    const char *type;
+    const char *charset;
+} http_mime_type;
+
 typedef struct {
     char mode[8];
     char color[8];
@@ -79,6 +91,8 @@ extern const http_status http_statuses[];
 extern const http_status_msg http_status_messages[];
 extern const int http_statuses_size;
 extern const int http_status_messages_size;
+extern const http_mime_type http_mime_types[];
+extern const int http_mime_types_size;
 
 extern const char http_default_document[];
 extern const char http_error_document[];
@@ -116,14 +130,26 @@ const http_status *http_get_status(unsigned short status_code);
 
 const http_status_msg *http_get_error_msg(const http_status *status);
 
+const http_mime_type *http_get_mime_type(const char *filename);
+
 const char *http_get_status_color(const http_status *status);
 
 char *http_format_date(time_t time, char *buf, size_t size);
 
 char *http_get_date(char *buf, size_t size);
 
+time_t http_parse_date(const char *date);
+
+int http_etag_match(const char *list, const char *etag);
+
+void http_merge_vary(http_hdr *hdr, const char *field_name);
+
 const http_doc_info *http_get_status_info(const http_status *status);
 
+int http_select_encoding(const char *accept_encoding, int available, int dynamic);
+
 int http_get_compression(const http_req *req, const http_res *res);
 
+int http_parse_ranges(const char *range, unsigned long size, http_range *ranges, int max_ranges);
+
 #endif //NECRONDA_SERVER_HTTP_H
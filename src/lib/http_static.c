@@ -103,6 +103,80 @@ const http_status_msg http_status_messages[] = {
         {505, "The server does not support, or refuses to support, the HTTP protocol version that was used in the request message."}
 };
 
+// sorted by extension, charset NULL: detected by the cache updater
+const http_mime_type http_mime_types[] = {
+        {"7z",          "application/x-7z-compressed",   "binary"},
+        {"aac",         "audio/aac",                     "binary"},
+        {"apng",        "image/apng",                    "binary"},
+        {"asc",         "text/plain",                    NULL},
+        {"atom",        "application/atom+xml",          NULL},
+        {"avi",         "video/x-msvideo",               "binary"},
+        {"avif",        "image/avif",                    "binary"},
+        {"bin",         "application/octet-stream",      "binary"},
+        {"bmp",         "image/bmp",                     "binary"},
+        {"bz2",         "application/x-bzip2",           "binary"},
+        {"c",           "text/x-c",                      NULL},
+        {"cjs",         "application/javascript",        NULL},
+        {"conf",        "text/plain",                    NULL},
+        {"css",         "text/css",                      NULL},
+        {"csv",         "text/csv",                      NULL},
+        {"eot",         "application/vnd.ms-fontobject", "binary"},
+        {"epub",        "application/epub+zip",          "binary"},
+        {"flac",        "audio/flac",                    "binary"},
+        {"gif",         "image/gif",                     "binary"},
+        {"gz",          "application/gzip",              "binary"},
+        {"h",           "text/x-c",                      NULL},
+        {"htm",         "text/html",                     NULL},
+        {"html",        "text/html",                     NULL},
+        {"ico",         "image/vnd.microsoft.icon",      "binary"},
+        {"ics",         "text/calendar",                 NULL},
+        {"jpeg",        "image/jpeg",                    "binary"},
+        {"jpg",         "image/jpeg",                    "binary"},
+        {"js",          "application/javascript",        NULL},
+        {"json",        "application/json",              NULL},
+        {"jsonld",      "application/ld+json",           NULL},
+        {"m4a",         "audio/mp4",                     "binary"},
+        {"map",         "application/json",              NULL},
+        {"md",          "text/markdown",                 NULL},
+        {"mjs",         "application/javascript",        NULL},
+        {"mkv",         "video/x-matroska",              "binary"},
+        {"mp3",         "audio/mpeg",                    "binary"},
+        {"mp4",         "video/mp4",                     "binary"},
+        {"mpeg",        "video/mpeg",                    "binary"},
+        {"oga",         "audio/ogg",                     "binary"},
+        {"ogg",         "audio/ogg",                     "binary"},
+        {"ogv",         "video/ogg",                     "binary"},
+        {"opus",        "audio/opus",                    "binary"},
+        {"otf",         "font/otf",                      "binary"},
+        {"pdf",         "application/pdf",               "binary"},
+        {"png",         "image/png",                     "binary"},
+        {"rar",         "application/vnd.rar",           "binary"},
+        {"rss",         "application/rss+xml",           NULL},
+        {"rtf",         "application/rtf",               NULL},
+        {"sh",          "application/x-sh",              NULL},
+        {"svg",         "image/svg+xml",                 NULL},
+        {"tar",         "application/x-tar",             "binary"},
+        {"tif",         "image/tiff",                    "binary"},
+        {"tiff",        "image/tiff",                    "binary"},
+        {"ttf",         "font/ttf",                      "binary"},
+        {"txt",         "text/plain",                    NULL},
+        {"wasm",        "application/wasm",              "binary"},
+        {"wav",         "audio/wav",                     "binary"},
+        {"weba",        "audio/webm",                    "binary"},
+        {"webm",        "video/webm",                    "binary"},
+        {"webmanifest", "application/manifest+json",     NULL},
+        {"webp",        "image/webp",                    "binary"},
+        {"woff",        "font/woff",                     "binary"},
+        {"woff2",       "font/woff2",                    "binary"},
+        {"xhtml",       "application/xhtml+xml",         NULL},
+        {"xml",         "application/xml",               NULL},
+        {"xz",          "application/x-xz",              "binary"},
+        {"yaml",        "application/yaml",              NULL},
+        {"yml",         "application/yaml",              NULL},
+        {"zip",         "application/zip",               "binary"},
+        {"zst",         "application/zstd",              "binary"}
+};
+
 const char http_default_document[] =
         "<!DOCTYPE html>\n"
         "<html lang=\"en\">\n"
@@ -196,3 +270,4 @@ const char http_info_icon[] =
 
 const int http_statuses_size = sizeof(http_statuses);
 const int http_status_messages_size = sizeof(http_status_messages);
+const int http_mime_types_size = sizeof(http_mime_types);
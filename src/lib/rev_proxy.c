@@ -5,6 +5,8 @@
  * Lorenz Stechauner, 2021-01-07
  */
 
+#define _POSIX_C_SOURCE 199309L
+
 #include "rev_proxy.h"
 #include "utils.h"
 #include "compress.h"
@@ -15,6 +17,7 @@
 #include <openssl/err.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <time.h>
 
 sock rev_proxy;
 char *rev_proxy_host = NULL;
@@ -379,104 +382,206 @@ int rev_proxy_init(http_req *req, http_res *res, host_config *conf, sock *client
     return -1;
 }
 
-int rev_proxy_send(sock *client, unsigned long len_to_send, int flags) {
-    // TODO handle websockets
+static int rev_proxy_write(sock *client, compress_ctx *comp_ctx, const char *data, unsigned long len, int flags,
+                           int finish) {
+    char comp_out[CHUNK_SIZE];
+    char buf[24];
+    unsigned long avail_in = len, avail_out = 0;
     long ret;
+    do {
+        const char *ptr = data;
+        unsigned long buf_len = len;
+        if (flags & REV_PROXY_COMPRESS) {
+            avail_out = sizeof(comp_out);
+            compress_compress(comp_ctx, data + len - avail_in, &avail_in, comp_out, &avail_out, finish);
+            ptr = comp_out;
+            buf_len = sizeof(comp_out) - avail_out;
+        }
+        if (buf_len != 0) {
+            if (flags & REV_PROXY_CHUNKED_OUT) {
+                ret = sock_send(client, buf, sprintf(buf, "%lX\r\n", buf_len), 0);
+                if (ret <= 0) return -1;
+            }
+            ret = sock_send(client, (void *) ptr, buf_len, 0);
+            if (ret <= 0) return -1;
+            if (flags & REV_PROXY_CHUNKED_OUT) {
+                ret = sock_send(client, "\r\n", 2, 0);
+                if (ret <= 0) return -1;
+            }
+        }
+    } while ((flags & REV_PROXY_COMPRESS) && (avail_in != 0 || avail_out != sizeof(comp_out)));
+    return 0;
+}
+
+static int rev_proxy_wait(const struct timespec *begin) {
+    // the upstream only gets COMPRESS_BUFFER_TIMEOUT ms in total, a pausing response is streamed instead
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long timeout = COMPRESS_BUFFER_TIMEOUT - ((now.tv_sec - begin->tv_sec) * 1000 +
+                                              (now.tv_nsec - begin->tv_nsec) / 1000000);
+    return sock_wait(&rev_proxy, timeout > 0 ? (int) timeout : 0) == 1;
+}
+
+long rev_proxy_buffer(char *buf, unsigned long size, unsigned long *len_to_send, int *chunked) {
+    // reads up to size body bytes into buf, chunked bodies only up to a chunk boundary;
+    // the whole body has been read when *chunked and *len_to_send are both 0 afterwards
+    char buffer[17];
+    unsigned long len = 0;
+    long ret;
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    if (!*chunked) {
+        while (*len_to_send > 0 && len < size) {
+            if (!rev_proxy_wait(&begin)) {
+                return (long) len;
+            }
+            ret = sock_recv(&rev_proxy, buf + len, (size - len < *len_to_send) ? size - len : *len_to_send, 0);
+            if (ret <= 0) {
+                print("Unable to receive from server: %s", sock_strerror(&rev_proxy));
+                return -1;
+            }
+            len += ret;
+            *len_to_send -= ret;
+        }
+        return (long) len;
+    }
+
+    while (1) {
+        if (!rev_proxy_wait(&begin)) {
+            return (long) len;
+        }
+        ret = sock_recv(&rev_proxy, buffer, sizeof(buffer) - 1, MSG_PEEK);
+        if (ret <= 0) {
+            print("Unable to receive from server: %s", sock_strerror(&rev_proxy));
+            return -1;
+        }
+        buffer[ret] = 0;
+        char *pos = strstr(buffer, "\r\n");
+        if (pos == NULL) {
+            print(ERR_STR "Unable to parse chunk header" CLR_STR);
+            return -1;
+        }
+        unsigned long chunk_len = strtoul(buffer, NULL, 16);
+        if (chunk_len > size - len) {
+            // leave this chunk to rev_proxy_send()
+            return (long) len;
+        }
+        sock_recv(&rev_proxy, buffer, pos - buffer + 2, 0);
+
+        unsigned long rcv_len = 0;
+        while (rcv_len < chunk_len) {
+            ret = sock_recv(&rev_proxy, buf + len, chunk_len - rcv_len, 0);
+            if (ret <= 0) {
+                print("Unable to receive from server: %s", sock_strerror(&rev_proxy));
+                return -1;
+            }
+            rcv_len += ret;
+            len += ret;
+        }
+        sock_recv(&rev_proxy, buffer, 2, 0);
+
+        if (chunk_len == 0) {
+            *chunked = 0;
+            *len_to_send = 0;
+            return (long) len;
+        }
+    }
+}
+
+int rev_proxy_send(sock *client, unsigned long len_to_send, int flags, const char *buf, unsigned long buf_len) {
+    // TODO handle websockets
+    long ret = 0;
     char buffer[CHUNK_SIZE];
-    char comp_out[CHUNK_SIZE];
-    char buf[256];
-    long len, snd_len;
-    int finish_comp = 0;
-    char *ptr;
+    unsigned long snd_len;
+    int err = 0;
+
+    // compressed bodies are always sent chunked, their length is not known in advance
+    if (flags & (REV_PROXY_CHUNKED | REV_PROXY_COMPRESS)) {
+        flags |= REV_PROXY_CHUNKED_OUT;
+    }
 
     compress_ctx comp_ctx;
     if (flags & REV_PROXY_COMPRESS_BR) {
-        flags &= ~REV_PROXY_COMPRESS_GZ;
-        if (compress_init(&comp_ctx, COMPRESS_BR) != 0) {
+        flags &= ~(REV_PROXY_COMPRESS_GZ | REV_PROXY_COMPRESS_ZSTD);
+        if (compress_init_dynamic(&comp_ctx, COMPRESS_BR) != 0) {
             print(ERR_STR "Unable to init brotli: %s" CLR_STR, strerror(errno));
             flags &= ~REV_PROXY_COMPRESS_BR;
         }
+    } else if (flags & REV_PROXY_COMPRESS_ZSTD) {
+        flags &= ~(REV_PROXY_COMPRESS_GZ | REV_PROXY_COMPRESS_BR);
+        if (compress_init_dynamic(&comp_ctx, COMPRESS_ZSTD) != 0) {
+            print(ERR_STR "Unable to init zstd: %s" CLR_STR, strerror(errno));
+            flags &= ~REV_PROXY_COMPRESS_ZSTD;
+        }
     } else if (flags & REV_PROXY_COMPRESS_GZ) {
-        flags &= ~REV_PROXY_COMPRESS_BR;
-        if (compress_init(&comp_ctx, COMPRESS_GZ) != 0) {
+        flags &= ~(REV_PROXY_COMPRESS_BR | REV_PROXY_COMPRESS_ZSTD);
+        if (compress_init_dynamic(&comp_ctx, COMPRESS_GZ) != 0) {
             print(ERR_STR "Unable to init gzip: %s" CLR_STR, strerror(errno));
             flags &= ~REV_PROXY_COMPRESS_GZ;
         }
     }
 
-    do {
-        snd_len = 0;
+    // chunks may be sent as events arrive, compressed data is flushed at every upstream chunk boundary
+    if (buf_len > 0 && rev_proxy_write(client, &comp_ctx, buf, buf_len, flags,
+                                       (flags & REV_PROXY_CHUNKED) ? COMPRESS_FLUSH : 0) != 0) {
+        print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
+        err = 1;
+    }
+
+    while (!err && ((flags & REV_PROXY_CHUNKED) || len_to_send > 0)) {
         if (flags & REV_PROXY_CHUNKED) {
             char *pos;
             ret = sock_recv(&rev_proxy, buffer, 16, MSG_PEEK);
-            if (ret <= 0) goto err0;
-
+            if (ret <= 0) {
+                print("Unable to receive from server: %s", sock_strerror(&rev_proxy));
+                err = 1;
+                break;
+            }
             len_to_send = strtol(buffer, NULL, 16);
             pos = strstr(buffer, "\r\n");
-            len = pos - buffer + 2;
-            sock_recv(&rev_proxy, buffer, len, 0);
+            ret = sock_recv(&rev_proxy, buffer, pos - buffer + 2, 0);
             if (ret <= 0) {
-                err0:
                 print("Unable to receive from server: %s", sock_strerror(&rev_proxy));
+                err = 1;
                 break;
             }
-
-            if (len_to_send == 0 && (flags & REV_PROXY_COMPRESS)) {
-                finish_comp = 1;
-                len = 0;
-                goto out;
-                finish:
-                compress_free(&comp_ctx);
-            }
         }
+
+        snd_len = 0;
         while (snd_len < len_to_send) {
-            unsigned long avail_in, avail_out;
             ret = sock_recv(&rev_proxy, buffer, CHUNK_SIZE < (len_to_send - snd_len) ? CHUNK_SIZE : len_to_send - snd_len, 0);
             if (ret <= 0) {
                 print("Unable to receive from server: %s", sock_strerror(&rev_proxy));
+                err = 1;
                 break;
             }
-            len = ret;
-            ptr = buffer;
-            out:
-            avail_in = len;
-            void *next_in = ptr;
-            do {
-                long buf_len = len;
-                if (flags & REV_PROXY_COMPRESS) {
-                    avail_out = sizeof(comp_out);
-                    compress_compress(&comp_ctx, next_in + len - avail_in, &avail_in, comp_out, &avail_out,
-                                      finish_comp);
-                    ptr = comp_out;
-                    buf_len = (int) (sizeof(comp_out) - avail_out);
-                    snd_len += (long) (len - avail_in);
-                }
-                if (buf_len != 0) {
-                    len = sprintf(buf, "%lX\r\n", buf_len);
-                    ret = 1;
-                    if (flags & REV_PROXY_CHUNKED) ret = sock_send(client, buf, len, 0);
-                    if (ret <= 0) goto err;
-                    ret = sock_send(client, ptr, buf_len, 0);
-                    if (ret <= 0) goto err;
-                    if (!(flags & REV_PROXY_COMPRESS)) snd_len += ret;
-                    if (flags & REV_PROXY_CHUNKED) ret = sock_send(client, "\r\n", 2, 0);
-                    if (ret <= 0) {
-                        err:
-                        print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
-                        break;
-                    }
-                }
-            } while ((flags & REV_PROXY_COMPRESS) && (avail_in != 0 || avail_out != sizeof(comp_out)));
-            if (ret <= 0) break;
-            if (finish_comp) goto finish;
+            snd_len += ret;
+            if (rev_proxy_write(client, &comp_ctx, buffer, ret, flags, 0) != 0) {
+                print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
+                err = 1;
+                break;
+            }
+        }
+        if (err) break;
+        if (!(flags & REV_PROXY_CHUNKED)) break;
+        sock_recv(&rev_proxy, buffer, 2, 0);
+        if (len_to_send == 0) break;
+        if ((flags & REV_PROXY_COMPRESS) && rev_proxy_write(client, &comp_ctx, NULL, 0, flags, COMPRESS_FLUSH) != 0) {
+            print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
+            err = 1;
+            break;
         }
-        if (ret <= 0) break;
-        if (flags & REV_PROXY_CHUNKED) sock_recv(&rev_proxy, buffer, 2, 0);
-    } while ((flags & REV_PROXY_CHUNKED) && len_to_send > 0);
+    }
 
-    if (ret <= 0) return (int) -1;
+    if (!err && (flags & REV_PROXY_COMPRESS) && rev_proxy_write(client, &comp_ctx, NULL, 0, flags, 1) != 0) {
+        print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
+        err = 1;
+    }
+    if (flags & REV_PROXY_COMPRESS) compress_release(&comp_ctx);
+    if (err) return -1;
 
-    if (flags & REV_PROXY_CHUNKED) {
+    if (flags & REV_PROXY_CHUNKED_OUT) {
         ret = sock_send(client, "0\r\n\r\n", 5, 0);
         if (ret <= 0) {
             print(ERR_STR "Unable to send: %s" CLR_STR, sock_strerror(client));
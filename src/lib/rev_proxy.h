@@ -11,7 +11,9 @@
 #define REV_PROXY_CHUNKED 1
 #define REV_PROXY_COMPRESS_GZ 2
 #define REV_PROXY_COMPRESS_BR 4
-#define REV_PROXY_COMPRESS 6
+#define REV_PROXY_COMPRESS_ZSTD 8
+#define REV_PROXY_COMPRESS 14
+#define REV_PROXY_CHUNKED_OUT 16
 
 #include "http.h"
 #include "config.h"
@@ -27,6 +29,8 @@ int rev_proxy_response_header(http_req *req, http_res *res);
 int rev_proxy_init(http_req *req, http_res *res, host_config *conf, sock *client, http_status *custom_status,
                    char *err_msg);
 
-int rev_proxy_send(sock *client, unsigned long len_to_send, int flags);
+long rev_proxy_buffer(char *buf, unsigned long size, unsigned long *len_to_send, int *chunked);
+
+int rev_proxy_send(sock *client, unsigned long len_to_send, int flags, const char *buf, unsigned long buf_len);
 
 #endif //NECRONDA_SERVER_REV_PROXY_H
@@ -5,12 +5,16 @@
  * Lorenz Stechauner, 2021-01-07
  */
 
+#define _GNU_SOURCE
+
 #include "sock.h"
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <unistd.h>
+#include <poll.h>
 
 const char *sock_strerror(sock *s) {
     if (s->_last_ret == 0) {
@@ -51,8 +55,14 @@ const char *sock_strerror(sock *s) {
 long sock_send(sock *s, void *buf, unsigned long len, int flags) {
     long ret;
     if (s->enc) {
-        ret = SSL_write(s->ssl, buf, (int) len);
-        s->_ssl_error = ERR_get_error();
+        // partial writes are enabled, but callers expect the whole buffer to be sent
+        unsigned long snd_len = 0;
+        do {
+            ret = SSL_write(s->ssl, (char *) buf + snd_len, (int) (len - snd_len));
+            s->_ssl_error = ERR_get_error();
+            if (ret > 0) snd_len += ret;
+        } while (ret > 0 && snd_len < len);
+        if (ret > 0) ret = (long) snd_len;
     } else {
         ret = send(s->socket, buf, len, flags);
     }
@@ -95,6 +105,33 @@ long sock_splice(sock *dst, sock *src, void *buf, unsigned long buf_len, unsigne
     return (long) send_len;
 }
 
+long sock_send_file(sock *s, int fd, unsigned long off, unsigned long len, void *buf, unsigned long buf_len, int flags) {
+    long ret;
+    unsigned long send_len = 0;
+    unsigned long next_len;
+    off_t offset = (off_t) off;
+    while (send_len < len) {
+        if (!s->enc) {
+            // zero-copy, the kernel reads directly from the page cache
+            ret = sendfile(s->socket, fd, &offset, len - send_len);
+            s->_last_ret = ret;
+            s->_errno = errno;
+            if (ret < 0) return -1;
+            if (ret == 0) return -2;
+        } else {
+            next_len = (buf_len < (len - send_len)) ? buf_len : (len - send_len);
+            ret = pread(fd, buf, next_len, (long) (off + send_len));
+            if (ret <= 0) return -2;
+            next_len = ret;
+            ret = sock_send(s, buf, next_len, send_len + next_len < len ? MSG_MORE : flags);
+            if (ret < 0) return -1;
+            if (ret != next_len) return -3;
+        }
+        send_len += ret;
+    }
+    return (long) send_len;
+}
+
 int sock_close(sock *s) {
     if ((int) s->enc && s->ssl != NULL) {
         if (s->_last_ret >= 0) SSL_shutdown(s->ssl);
@@ -108,6 +145,17 @@ int sock_close(sock *s) {
     return 0;
 }
 
+int sock_wait(sock *s, int timeout) {
+    // 1 if data can be read, 0 after timeout milliseconds
+    if (s->enc && SSL_pending(s->ssl) > 0) {
+        return 1;
+    }
+    struct pollfd fds = {.fd = s->socket, .events = POLLIN};
+    int ret = poll(&fds, 1, timeout);
+    s->_errno = errno;
+    return ret < 0 ? -1 : ret > 0;
+}
+
 int sock_check(sock *s) {
     char buf;
     return recv(s->socket, &buf, 1, MSG_PEEK | MSG_DONTWAIT) == 1;
@@ -31,8 +31,12 @@ long sock_recv(sock *s, void *buf, unsigned long len, int flags);
 
 long sock_splice(sock *dst, sock *src, void *buf, unsigned long buf_len, unsigned long len);
 
+long sock_send_file(sock *s, int fd, unsigned long off, unsigned long len, void *buf, unsigned long buf_len, int flags);
+
 int sock_close(sock *s);
 
+int sock_wait(sock *s, int timeout);
+
 int sock_check(sock *s);
 
 #endif //NECRONDA_SERVER_SOCK_H
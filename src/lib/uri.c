@@ -190,6 +190,7 @@ void uri_free(http_uri *uri) {
     if (uri->query != NULL) free(uri->query);
     if (uri->filename != NULL) free(uri->filename);
     if (uri->uri != NULL) free(uri->uri);
+    if (uri->meta != NULL) free(uri->meta);
     uri->webroot = NULL;
     uri->req_path = NULL;
     uri->path = NULL;
@@ -197,4 +198,5 @@ void uri_free(http_uri *uri) {
     uri->query = NULL;
     uri->filename = NULL;
     uri->uri = NULL;
+    uri->meta = NULL;
 }
@@ -17,10 +17,11 @@
 
 typedef struct {
     char etag[64];
-    char type[24];
+    char type[32];
     char charset[16];
     char filename_comp_gz[256];
     char filename_comp_br[256];
+    char filename_comp_zst[256];
     struct stat stat;
 } meta_data;
 
@@ -131,3 +131,10 @@ int mime_is_compressible(const char *type) {
         strcmp(type_parsed, "image/vnd.microsoft.icon") == 0 ||
         strcmp(type_parsed, "image/x-icon") == 0;
 }
+
+int mime_is_stream(const char *type) {
+    // open-ended responses, every piece has to reach the client as soon as it is produced
+    if (type == NULL) return 0;
+    unsigned long len = strlen("text/event-stream");
+    return strncmp(type, "text/event-stream", len) == 0 && (type[len] == 0 || type[len] == ';' || type[len] == ' ');
+}
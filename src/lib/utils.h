@@ -40,4 +40,6 @@ int url_decode(const char *str, char *dec, long *size);
 
 int mime_is_compressible(const char *type);
 
+int mime_is_stream(const char *type);
+
 #endif //NECRONDA_SERVER_UTILS_H
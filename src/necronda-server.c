@@ -5,7 +5,7 @@
  * Lorenz Stechauner, 2020-12-03
  */
 
-#define _POSIX_C_SOURCE 199309L
+#define _POSIX_C_SOURCE 200809L
 
 #include "necronda.h"
 #include "necronda-server.h"
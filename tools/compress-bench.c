@@ -0,0 +1,188 @@
+/**
+ * Necronda Web Server
+ * Benchmark of the cache compression paths
+ * tools/compress-bench.c
+ * Lorenz Stechauner, 2021-05-06
+ *
+ * Concatenates the given files to inputs of 1, 2, 4, 8, 16 and 32 MiB and compresses each one the way
+ * the cache does: gzip in one shot (libdeflate), gzip streamed (zlib), gzip split into blocks (zlib, one
+ * thread per block), brotli and zstd. The levels are those of the first pass (-f) or of the refinement (default).
+ * Block-parallel gzip only pays off where it shortens the whole job, i.e. where gzip and not brotli
+ * or zstd is the slowest encoding of a file.
+ *
+ * Usage: compress-bench [-f] [-t threads] file...
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "../src/lib/compress.h"
+#include "../src/lib/cache.h"
+#include <libdeflate.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+    const unsigned char *buf;
+    unsigned long size, len;
+    int level, block;
+} bench_block;
+
+static double bench_time(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void *bench_gz_block(void *arg) {
+    // same as cache_job_compress_block()
+    bench_block *b = arg;
+    unsigned long off = (unsigned long) b->block * CACHE_PAR_BLOCK_SIZE;
+    unsigned long len = (b->size - off < CACHE_PAR_BLOCK_SIZE) ? b->size - off : CACHE_PAR_BLOCK_SIZE;
+    int last = off + len == b->size;
+    z_stream strm = {.zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL};
+
+    deflateInit2(&strm, b->level, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY);
+    if (off > 0) {
+        unsigned long dict_len = (off < CACHE_PAR_DICT_SIZE) ? off : CACHE_PAR_DICT_SIZE;
+        deflateSetDictionary(&strm, b->buf + off - dict_len, dict_len);
+    }
+    unsigned long size = deflateBound(&strm, len) + 16;
+    unsigned char *out = malloc(size);
+    strm.next_in = (unsigned char *) b->buf + off;
+    strm.avail_in = len;
+    strm.next_out = out;
+    strm.avail_out = size;
+    deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+    (void) crc32(0, b->buf + off, len);
+    deflateEnd(&strm);
+    free(out);
+    b->len = size - strm.avail_out;
+    return NULL;
+}
+
+static unsigned long bench_gz_oneshot(const unsigned char *buf, unsigned long size, int level) {
+    struct libdeflate_compressor *compressor = libdeflate_alloc_compressor(level);
+    unsigned long bound = libdeflate_gzip_compress_bound(compressor, size);
+    unsigned char *out = malloc(bound);
+    unsigned long len = libdeflate_gzip_compress(compressor, buf, size, out, bound);
+    libdeflate_free_compressor(compressor);
+    free(out);
+    return len;
+}
+
+static unsigned long bench_gz_blocks(const unsigned char *buf, unsigned long size, int level, int threads) {
+    // up to threads blocks at once, like the cache workers
+    int blocks = (int) ((size + CACHE_PAR_BLOCK_SIZE - 1) / CACHE_PAR_BLOCK_SIZE);
+    bench_block *b = calloc(blocks, sizeof(bench_block));
+    pthread_t *thr = calloc(threads, sizeof(pthread_t));
+    unsigned long len = 10 + 8;
+    for (int i = 0; i < blocks; i += threads) {
+        int n = (blocks - i < threads) ? blocks - i : threads;
+        for (int j = 0; j < n; j++) {
+            b[i + j] = (bench_block) {.buf = buf, .size = size, .level = level, .block = i + j};
+            pthread_create(&thr[j], NULL, bench_gz_block, &b[i + j]);
+        }
+        for (int j = 0; j < n; j++) {
+            pthread_join(thr[j], NULL);
+            len += b[i + j].len;
+        }
+    }
+    free(thr);
+    free(b);
+    return len;
+}
+
+static unsigned long bench_stream(const unsigned char *buf, unsigned long size, int mode, int level) {
+    // same as cache_job_compress()
+    compress_ctx comp_ctx;
+    unsigned long off = 0, len = 0;
+    char out[CACHE_BUF_SIZE];
+    compress_init_level(&comp_ctx, mode, level, level, level);
+    do {
+        unsigned long in_len = (size - off < CACHE_BUF_SIZE) ? size - off : CACHE_BUF_SIZE;
+        unsigned long avail_in = in_len, avail_out;
+        int finish = off + in_len == size;
+        do {
+            avail_out = sizeof(out);
+            compress_compress_mode(&comp_ctx, mode, (const char *) buf + off + in_len - avail_in, &avail_in, out,
+                                   &avail_out, finish);
+            len += sizeof(out) - avail_out;
+        } while (avail_in != 0 || avail_out != sizeof(out));
+        off += in_len;
+    } while (off < size);
+    compress_free(&comp_ctx);
+    return len;
+}
+
+int main(int argc, char *argv[]) {
+    int fast = 0, threads = (int) sysconf(_SC_NPROCESSORS_ONLN), opt;
+    while ((opt = getopt(argc, argv, "ft:")) != -1) {
+        if (opt == 'f') {
+            fast = 1;
+        } else if (opt == 't') {
+            threads = (int) strtol(optarg, NULL, 10);
+        } else {
+            fprintf(stderr, "Usage: %s [-f] [-t threads] file...\n", argv[0]);
+            return 1;
+        }
+    }
+    if (threads < 1) threads = 1;
+    int level_gz = fast ? CACHE_FAST_LEVEL_GZIP : COMPRESS_LEVEL_GZIP;
+    int level_br = fast ? CACHE_FAST_LEVEL_BROTLI : COMPRESS_LEVEL_BROTLI;
+    int level_zstd = fast ? CACHE_FAST_LEVEL_ZSTD : COMPRESS_LEVEL_ZSTD;
+
+    unsigned long max_size = 32UL * 1024 * 1024, size = 0;
+    unsigned char *buf = malloc(max_size);
+    if (buf == NULL) {
+        fprintf(stderr, "Unable to allocate memory\n");
+        return 1;
+    }
+    for (int i = optind; i < argc && size < max_size; i++) {
+        FILE *file = fopen(argv[i], "rb");
+        if (file == NULL) continue;
+        size += fread(buf + size, 1, max_size - size, file);
+        fclose(file);
+    }
+    if (size < 1024 * 1024) {
+        fprintf(stderr, "Less than 1 MiB of input\n");
+        free(buf);
+        return 1;
+    }
+
+    printf("levels gzip %i, br %i, zstd %i; %i threads; times in s (wall/cpu)\n", level_gz, level_br, level_zstd,
+           threads);
+    printf("%6s  %-19s  %-19s  %-24s  %-19s  %-19s\n", "MiB", "gzip one-shot", "gzip stream", "gzip blocks", "br",
+           "zstd");
+    for (unsigned long input = 1024 * 1024; input <= size; input *= 2) {
+        double w, c;
+        unsigned long len;
+        printf("%6lu", input / 1024 / 1024);
+
+        w = bench_time(CLOCK_MONOTONIC);
+        len = bench_gz_oneshot(buf, input, level_gz);
+        printf("  %6.2f       %.4f", bench_time(CLOCK_MONOTONIC) - w, (double) len / (double) input);
+
+        w = bench_time(CLOCK_MONOTONIC);
+        len = bench_stream(buf, input, COMPRESS_GZ, level_gz);
+        printf("  %6.2f       %.4f", bench_time(CLOCK_MONOTONIC) - w, (double) len / (double) input);
+
+        w = bench_time(CLOCK_MONOTONIC), c = bench_time(CLOCK_PROCESS_CPUTIME_ID);
+        len = bench_gz_blocks(buf, input, level_gz, threads);
+        printf("  %6.2f/%6.2f     %.4f", bench_time(CLOCK_MONOTONIC) - w, bench_time(CLOCK_PROCESS_CPUTIME_ID) - c,
+               (double) len / (double) input);
+
+        w = bench_time(CLOCK_MONOTONIC);
+        len = bench_stream(buf, input, COMPRESS_BR, level_br);
+        printf("  %6.2f       %.4f", bench_time(CLOCK_MONOTONIC) - w, (double) len / (double) input);
+
+        w = bench_time(CLOCK_MONOTONIC);
+        len = bench_stream(buf, input, COMPRESS_ZSTD, level_zstd);
+        printf("  %6.2f       %.4f\n", bench_time(CLOCK_MONOTONIC) - w, (double) len / (double) input);
+        fflush(stdout);
+    }
+    free(buf);
+    return 0;
+}